@@ -116,7 +116,7 @@ CONFIG    - The PIC18F25K50 configuration fuses should be set as follows (items
 OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
 
             .----------------.
-            |ux line1........|
+            |ux line1.......s|
             |yy line2........|
             '----------------'
 
@@ -134,8 +134,14 @@ OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
                 other usages.
             line1 = Text that describes the ux code
             yy = See below. Press and/or hold the UP and DOWN buttons to change
-                 the value of xyy.
+                 the value of xyy. The longer a button is held, the faster
+                 xyy changes, until it steps by 0x10 and then by 0x100.
             line2 = Text that describes the yy (or xyy) code.
+            s  = Status glyph. The top bar shows USB state (solid = ready,
+                 outline = suspended, dots = enumerating), the middle bar
+                 gets shorter the more IR noise or corrupted frames came
+                 before the last IR frame, and the bottom bar shows how
+                 many reports are waiting to be sent to the host.
 
 
             The meanings id u, x and yy are as follows:
@@ -165,6 +171,13 @@ OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
             10 81   Power off
             10 82   Sleep
             10 83   Wake
+            If the host has suspended the USB bus (e.g. it is asleep) then
+            the Wake command causes IRK! to signal a USB remote wakeup and
+            the Wake report is sent once the host has resumed. All other
+            commands are discarded while the host is suspended (unless
+            option flag 02 is set in EEPROM, see FORMATS below). Nothing
+            is signalled, and the command is discarded, if the host has not
+            enabled remote wakeup for IRK! (e.g. in Device Manager).
 
 
 
@@ -204,12 +217,13 @@ OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
                    - You then press up/down to cycle the address (aa) then
                      press OK to select it. The default address is AA.
             F0 01  Power Switch
-                   - The two header pins marked PWR will become low impedance for about
-                     250 ms.  Note: this is not meant to switch large currents. The 4066
-                     quad analog switch can pass an absolute maximum of only +/- 25 mA.
+                   - The two header pins marked PWR will become low impedance for
+                     250 ms (or as set in EEPROM address 03).  Note: this is not meant
+                     to switch large currents. The 4066 quad analog switch can pass an
+                     absolute maximum of only +/- 25 mA.
             F0 02  Reset Switch
-                   - The two header pins marked RST will become low impedance for about
-                     250 ms.
+                   - The two header pins marked RST will become low impedance for
+                     250 ms (or as set in EEPROM address 04).
             F0 03  Init USB
                    - Causes the unit to re-register itself as a USB device. It is
                      almost the equivalent of unplugging and replugging the device
@@ -230,11 +244,15 @@ OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
                      press OK to select it.
             F0 07  Debug on 
                    - Displays debug information on the LCD when an IR code is received
+                   - While that is displayed, UP/DOWN scroll through the last 8
+                     IR frames received (valid or not), showing the address,
+                     uxyy, time received, outcome and decoder reset count.
+                     Any other button returns to the normal display.
             F0 08  Debug off 
                    - Returns the unit to Normal mode (displays no debug information on the LCD)
             F0 09  Auxiliary Switch (4066 analog switch number 3)
-                   - The two header pins marked AUX will become low impedance for about
-                     250 ms.
+                   - The two header pins marked AUX will become low impedance for
+                     250 ms (or as set in EEPROM address 05).
             F0 0A  Power Switch On
                    - The two header pins marked PWR will become low impedance until a
                      subsequent Power Switch Off command is received.
@@ -250,6 +268,12 @@ OPERATION - The user is presented with an LCD 2 x 16 display that looks like:
                    - The two header pins marked RST will become high impedance.
             F0 0F  Auxiliary Switch Off
                    - The two header pins marked AUX will become high impedance.
+            F0 10  Power Switch Hold
+                   - The two header pins marked PWR will become low impedance for
+                     5 seconds (or as set in EEPROM address 06), which forces most
+                     PCs to power off.
+                   - Switch pulses do not hold up IR or USB processing. A pulse can
+                     be cut short or extended by the matching On or Off command.
 
 
 FORMATS -  1. The IR transmission format sent to, and received from, your
@@ -302,6 +326,92 @@ FORMATS -  1. The IR transmission format sent to, and received from, your
             http://www.usb.org/developers/devclass_docs/HID1_11.pdf
             ...for more information on Report Id.
 
+           3. The host can read and write the configuration held in EEPROM
+           (device address, backlight delay, option flags) using a vendor-
+           defined report with Report Id REPORT_ID_CONFIG ('F'). Each 8-byte
+           Output report sent by the host is answered by one 8-byte Input
+           report in the same format:
+
+            'F' op aa nn dd dd dd dd
+
+            That is:
+            op  = 'I' Info: returns the config image size in the first dd
+                  'R' Read:  returns nn bytes of EEPROM starting at aa
+                  'W' Write: writes nn bytes to EEPROM starting at aa, then
+                             acts on the new configuration immediately
+                  'T' Telemetry: streams telemetry reports (see 4. below)
+                             for the next dd seconds (00 = stop)
+            aa  = EEPROM address (00 to FF)
+            nn  = Number of bytes (0 to 4). The reply contains the number of
+                  bytes actually read or written
+            dd  = Data bytes. The reply contains the EEPROM contents after the
+                  operation
+
+            EEPROM addresses used by IRK! are:
+            00  Device address
+            01  Backlight delay (00=Off, FF=On, else seconds)
+            02  Option flags (xxxxxxx1 = start up in debug mode,
+                              xxxxxx1x = any USB command wakes a suspended host)
+            03  Power Switch pulse (50 ms units, 00 or FF = 250 ms)
+            04  Reset Switch pulse (50 ms units, 00 or FF = 250 ms)
+            05  Auxiliary Switch pulse (50 ms units, 00 or FF = 250 ms)
+            06  Power Switch Hold (50 ms units, 00 or FF = 5 seconds)
+            07  Key repeat delay (50 ms units, 00 or FF = 750 ms)
+            08  Key repeat rate (steps a second up to 25, 00 or FF = 4)
+            All other EEPROM bytes are free for use by the host.
+
+           4. While the host keeps renewing its 'T' request, IRK! sends
+           telemetry using Input reports with Report Id REPORT_ID_TELEMETRY
+           ('T'). At most one telemetry report is sent every 40 ms, and
+           only when no keyboard or consumer reports are waiting:
+
+            'T' 'F' aa aa' ux ux' yy yy'  Last IR frame received
+            'T' 'R' oo rrrr wwww ss       Result of decoding that frame:
+                                          oo   = 00 OK, 01 Not for this IRK!,
+                                                 02 Bad address, 03 Bad
+                                                 modifiers, 04 Bad command
+                                          rrrr = Decoder resets so far
+                                          wwww = Last pulse width (Timer1 ticks)
+                                          ss   = Decoder state
+            'T' 'X' c0 c1 c2 c3 c4 c5     Decoder resets (once a second) by
+                                          reason: c0 capture restarted, c1
+                                          bad training pulse, c2 bad training
+                                          silence, c3 mark too long, c4 space
+                                          too long, c5 space too short
+            'T' 'U' qq bbbb dddd ss       USB statistics (once a second):
+                                          qq   = Reports queued for the host
+                                          bbbb = Times the host had not yet
+                                                 collected the previous report
+                                          dddd = Reports dropped
+                                          ss   = USB enumeration state
+            'T' 'S' iiii uuuu llll        Scheduler statistics (once a second):
+                                          iiii = Longest IR task run
+                                          uuuu = Longest USB task run
+                                          llll = Longest user interface
+                                                 (LCD and buttons) task run
+                                          ...in Timer3 counts of 0.67 us
+                                          (FFFF = 43 ms or more) since the
+                                          previous 'S' record
+            'T' 'I' mmmm aaaa dddd        Interrupt statistics (once a second):
+                                          mmmm = Longest run of the low
+                                                 priority interrupt handler
+                                          aaaa = Average run of the low
+                                                 priority interrupt handler
+                                          dddd = Longest delay between an IR
+                                                 edge and the high priority
+                                                 handler reading its capture
+                                          ...in Timer counts of 0.67 us since
+                                          the previous 'I' record. Run times
+                                          do not include the compiler's
+                                          context save and restore, nor the
+                                          high priority (IR capture) handler,
+                                          whose latency dddd reports instead.
+            'T' 'W' pp nnnn               Idle statistics (once a second):
+                                          pp   = Percentage of the time that
+                                                 the CPU spent in Idle mode
+                                          nnnn = Times the main loop went idle
+                                          ...since the previous 'W' record
+
 EXAMPLE  - 1. The user wants to program the Enter key on the OK button of a
               learning remote control. The steps to follow are:
               a. Plug IRK! into a host USB port
@@ -368,10 +478,17 @@ NOTES    - 1. The source code is written in MikroC Pro from mikroe.com
                 c    char             8 bit character
                 s    string           8 bit character array
 
-           4. Timer0 is used for LCD display backlight timeouts
+           4. Timer0 is the 1 ms system tick (wTicks and the software timers
+              used for the backlight, activity LED, debouncing, key repeat and
+              switch pulses)
               Timer1 is used for IR signal capture timings
-              Timer2 is used for IR signal transmission (PWM)
-              Timer3 is used for key repeats
+              Timer2 is used for IR signal transmission (PWM) and LCD writes
+              Timer3 free-runs (without interrupts) to time code for telemetry
+              All of them count 3 times slower while the host is suspended,
+              as the CPU then runs at 16 MHz instead of 48 MHz (see
+              useSlowClock). Timer0 is reloaded to keep a 1 ms tick and IR
+              pulse widths are scaled back to 48 MHz Timer1 units, but
+              telemetry (and so Timer3) is not used while suspended.
 
            5. IRK! will send *any* USB code that you select to the host - not
               just that ones that it displays with a name. For example, you can
@@ -396,6 +513,22 @@ NOTES    - 1. The source code is written in MikroC Pro from mikroe.com
               been reduced in duration so as not to adversely affect the
               operation of the TSOP4838 receiver as of v2.04.
 
+           7. Interrupt priorities are enabled (IPEN = 1). The CCP2 capture of
+              an IR edge is the only high priority interrupt (apart from INT0,
+              which the PIC18 always treats as high priority and which is just
+              passed on to the next tick), so its handler interrupts anything
+              else, including the USB, timer, LCD and button handling in the
+              low priority handler. An IR edge is therefore serviced within
+              the interrupt response time plus the longest stretch that runs
+              with GIE clear (a few instructions where main() snapshots shared
+              counters), i.e. a few microseconds. This matters because Timer1
+              is restarted by the handler, not by the edge, so each service
+              delay shortens the next pulse width measured. The 'I' telemetry
+              record reports the longest delay actually seen (dddd), which
+              should stay far below WIDTH_ERROR_MARGIN. Its run times (mmmm
+              and aaaa) cover only the low priority handler, since that is
+              what can hold up main().
+
 REFERENCE - USB Human Interface Device Usage Tables at:
             http://www.usb.org/developers/devclass_docs/Hut1_12v2.pdf
 
@@ -409,9 +542,34 @@ REFERENCE - USB Human Interface Device Usage Tables at:
 AUTHORS  - Init Name                 Email
            ---- -------------------- ------------------------------------------
            AJA  Andrew J. Armstrong  androidarmstrong@gmail.com
+           AGT  agent                agent@local
 
 HISTORY  - Date     Ver   By  Reason (most recent at the top please)
            -------- ----- --- -------------------------------------------------
+           20261018 3.05  AGT Host configuration: the whole EEPROM config
+                              image can be read and written over USB ('F'
+                              reports), including switch pulse lengths, the
+                              power hold time and the key repeat delay/rate.
+                              USB: enumeration no longer blocks the main loop,
+                              reports are queued, and a suspended host can be
+                              woken by remote wakeup (Wake, or any command if
+                              option flag 02 is set). While suspended IRK!
+                              idles, slows its clock and turns the LCD off,
+                              and still wakes on an IR edge. Added 'T'
+                              telemetry reports (frames, decoder resets, USB,
+                              task, interrupt and idle statistics).
+                              LCD: output is queued and written by Timer2,
+                              only changed characters are redrawn and redraws
+                              are rate limited. Added a status glyph (USB, IR
+                              noise, queue) and a history of the last 8 IR
+                              frames. Key names come from ROM tables.
+                              Buttons are interrupt driven and debounced, and
+                              UP/DOWN/OK repeat at a configurable, speeding up
+                              rate. A 1 ms tick drives software timers, so the
+                              PWR/RST/AUX pulses no longer block. IR capture is
+                              now the only high priority interrupt. USB is
+                              attached before the LCD is initialised, and
+                              debug mode shows the boot times.
            20141002 3.04  AJA Use Hi() and Lo() built in functions.
            20131229 3.03  AJA Added local IRK! functions to turn on and off the
                               4066 analog switches (PWR, RST and AUX). The
@@ -500,7 +658,7 @@ HISTORY  - Date     Ver   By  Reason (most recent at the top please)
 #include "assign_pins.h"
 #include <built_in.h>
 
-#define IRK_VERSION "3.04"
+#define IRK_VERSION "3.05"
 
 #define OUTPUT        0
 #define INPUT         1
@@ -529,6 +687,7 @@ HISTORY  - Date     Ver   By  Reason (most recent at the top please)
 // LCD characters loaded into CGRAM:
 #define UP_ARROW     0x01
 #define DOWN_ARROW   0x02
+#define STATUS_GLYPH 0x08    // CGRAM symbol #0 (redrawn by updateStatusGlyph)
 
 // define some easy to remember types
 typedef unsigned short  byte;
@@ -596,11 +755,19 @@ volatile byte                      cFlags;
 #define bDebugMode                 cFlags.B6
 #define bSettingBacklightDelay     cFlags.B5
 #define bSettingUsage              cFlags.B4
-#define bLastUSBPower              cFlags.B3
+#define bShowingHistory            cFlags.B3
 #define bSettingDeviceAddress      cFlags.B2
-#define bKeyRepeatPending          cFlags.B1
+#define bButtonEdgePending         cFlags.B1
 #define bUSBReady                  cFlags.B0
 
+volatile byte                      cUSBFlags;
+#define bUSBSuspended              cUSBFlags.B0
+#define bLowPowerMode              cUSBFlags.B1
+#define bTelemetryOn               cUSBFlags.B2
+#define bSlowClock                 cUSBFlags.B3
+#define bConfigReplyPending        cUSBFlags.B4
+#define bRemoteWakeupEnabled       cUSBFlags.B5
+
 byte nState;
 #define STATE_IR_RESET                   0
 #define STATE_IR_TRAINING_RECEIVED       1
@@ -609,9 +776,63 @@ byte nState;
 
 unsigned int nResetCount;
 
+// Reasons for the IR decoder returning to STATE_IR_RESET (for telemetry)...
+#define RESET_CAPTURE_RESTART            0  // Capture (re)started
+#define RESET_BAD_TRAINING_PULSE         1  // First pulse was not a training pulse
+#define RESET_BAD_TRAINING_SILENCE       2  // Silence after training pulse was wrong
+#define RESET_MARK_TOO_LONG              3  // Mark between bits was too long
+#define RESET_SPACE_TOO_LONG             4  // Space was too long for a 1 bit
+#define RESET_SPACE_TOO_SHORT            5  // Space was too short for a 0 bit
+#define RESET_REASONS                    6
+byte nResetReasonCount[RESET_REASONS];      // Saturating counts since last telemetry report
+
+// Outcome of checking a complete 6-byte IR frame...
+#define FRAME_OK                         0  // Valid command for this device
+#define FRAME_NOT_FOR_US                 1  // Addressed to some other IRK!
+#define FRAME_BAD_ADDRESS                2  // Address check byte mismatch
+#define FRAME_BAD_MODIFIERS              3  // Modifiers check byte mismatch
+#define FRAME_BAD_COMMAND                4  // Command check byte mismatch
+
+// The last few IR frames received (valid or not), newest first, that can be
+// scrolled through with UP/DOWN in debug mode...
+typedef struct
+{
+  unsigned int wReceivedTicks;              // wTicks when the frame was received
+  unsigned int uxyy;                        // Modifiers and command bytes as received
+  unsigned int wResetCount;                 // nResetCount when the frame was received
+  byte nAddress;                            // Address byte as received
+  byte nOutcome;                            // FRAME_xxx outcome of the frame
+} t_frameRecord;
+#define FRAME_HISTORY_SIZE               8  // Number of frames (must be a power of 2)
+t_frameRecord frameHistory[FRAME_HISTORY_SIZE];
+byte nFrameHistoryNext;                     // Entry the next frame will be recorded in
+byte nFrameHistoryCount;                    // Number of entries recorded (up to FRAME_HISTORY_SIZE)
+byte nFrameHistoryView;                     // Entry being displayed (0 = newest)
+byte nResetsSinceFrame;                     // Decoder resets (other than capture restarts) since the last frame
+byte nResetsBeforeFrame;                    // ...and before the last frame, for the status glyph
+
 byte nConfigDeviceAddress;
 byte nConfigBacklightDelay;
 byte nNewBacklightDelay;
+byte nConfigOptions;
+
+// EEPROM configuration image. The host can read and write any EEPROM byte
+// using the configuration channel (see REPORT_ID_CONFIG) but the following
+// are the bytes that IRK! itself acts on. An erased EEPROM byte reads as 0xFF.
+#define EEPROM_DEVICE_ADDRESS         0x00  // This IRK! device's IR address
+#define EEPROM_BACKLIGHT_DELAY        0x01  // Backlight on for nn seconds (00=Off, FF=On)
+#define EEPROM_OPTIONS                0x02  // Option flags (FF=erased, treated as 00)
+#define EEPROM_POWER_PULSE            0x03  // Switch pulse lengths in 50 ms units...
+#define EEPROM_RESET_PULSE            0x04
+#define EEPROM_AUX_PULSE              0x05
+#define EEPROM_POWER_HOLD             0x06  // ...(00 or FF = use the default)
+#define EEPROM_KEY_REPEAT_DELAY       0x07  // Key repeat delay in 50 ms units (00 or FF = 750 ms)
+#define EEPROM_KEY_REPEAT_RATE        0x08  // Key repeat rate in steps a second (00 or FF = 4)
+#define CONFIG_IMAGE_SIZE             9     // Number of EEPROM bytes used by IRK! (00 to 08)
+#define EEPROM_SIZE                   256   // PIC18F25K50 data EEPROM size
+
+#define OPTION_DEBUG_MODE             0x01  // Start up in debug mode
+#define OPTION_WAKE_ON_ANY_KEY        0x02  // Any USB command wakes a suspended host
 
 // Local IRK! function codes...
 #define CMD_SET_DEVICE_ADDRESS        0x00
@@ -630,6 +851,11 @@ byte nNewBacklightDelay;
 #define CMD_POWER_SWITCH_OFF          0x0D
 #define CMD_RESET_SWITCH_OFF          0x0E
 #define CMD_AUX_SWITCH_OFF            0x0F
+#define CMD_HOLD_POWER_SWITCH         0x10
+
+#define SWITCH_PULSE_UNIT_TICKS       50    // EEPROM pulse lengths are in 50 ms units
+#define DEFAULT_SWITCH_PULSE          5     // 250 ms
+#define DEFAULT_POWER_HOLD            100   // 5 seconds (long enough to force a power off)
 
 
 // Note that for a Vishay TSOP4838 IR receiver module, all IR bursts should
@@ -637,10 +863,20 @@ byte nNewBacklightDelay;
 // noise and reduce the sensitivity of the device for a period of about 4 times
 // the duration of the burst.
 
-// Set the Timer0 constant for a 1 second interrupt:
+// Set the Timer0 constant for a 1 millisecond interrupt (the system tick):
 #define CLOCK_FREQUENCY       (__FOSC__ * 1000)
-#define TIMER0_PRESCALER      256
-#define ONE_SECOND            (65535 - (CLOCK_FREQUENCY/4/TIMER0_PRESCALER))
+#define TIMER0_PRESCALER      8
+#define ONE_MILLISECOND       (65536 - (CLOCK_FREQUENCY/4/TIMER0_PRESCALER/1000))
+#define TICKS_PER_SECOND      1000
+
+// ...and for the slow clock (HFINTOSC without the PLL) used while the host is
+// suspended. Timer0 then ticks at 16 MHz/4/8 = 500 kHz. IR pulse widths are
+// multiplied by SLOW_CLOCK_DIVISOR to keep them in MICROSECONDS() units, so the
+// slow clock is only used when that is exact (48 MHz, not 24 MHz):
+#define SLOW_CLOCK_FREQUENCY  16000000
+#define SLOW_CLOCK_DIVISOR    (CLOCK_FREQUENCY / SLOW_CLOCK_FREQUENCY) // 3 at 48 MHz
+#define SLOW_CLOCK_USABLE     (SLOW_CLOCK_DIVISOR > 1 && CLOCK_FREQUENCY % SLOW_CLOCK_FREQUENCY == 0)
+#define ONE_MILLISECOND_SLOW  (65536 - (SLOW_CLOCK_FREQUENCY/4/TIMER0_PRESCALER/1000))
 
 // The following delays are in microseconds and are used as-is when
 // transmitting an IR signal...
@@ -672,14 +908,95 @@ byte nNewBacklightDelay;
 
 #define TIMER3_PRESCALER      8
 #define TIMER3_RATE (CLOCK_FREQUENCY/4/TIMER3_PRESCALER)
-#define TIMER3_INTERRUPTS_PER_SECOND (TIMER3_RATE / 65536)
-#define KEY_REPEAT_DELAY_IN_SECONDS 0.75
-#define KEY_REPEAT_DELAY_IN_TICKS (KEY_REPEAT_DELAY_IN_SECONDS * TIMER3_INTERRUPTS_PER_SECOND)
-volatile signed short nKeyRepeatDelay; // Number of Timer3 ticks before key repeat starts
-
-#define FRONT_PANEL_KEY_REPEAT_RATE_IN_HZ 4.0
-#define FRONT_PANEL_KEY_REPEAT_TICKS (TIMER3_INTERRUPTS_PER_SECOND / FRONT_PANEL_KEY_REPEAT_RATE_IN_HZ)
-byte nTicksPerKeyRepeat;
+#define TIMER3_WRAP_TICKS (65536 / (TIMER3_RATE / TICKS_PER_SECOND)) // Timer3 wraps every 43 ms at 48 MHz
+
+volatile unsigned int wTicks;          // Number of ms since power up (free running)
+
+// Software timers, all counted down by the system tick. A timer is started by
+// setting it to a number of ticks (ms). When it reaches 0 interrupt_low() acts on
+// it (see runSoftwareTimers) and it stays at 0 (stopped) until started again.
+#define TIMER_BACKLIGHT           0     // Restarted every second while nBacklightDelay counts down
+#define TIMER_ACTIVITY_LED        1     // Turns the activity LED off
+#define TIMER_DEBOUNCE            2     // Buttons are ignored while their contacts settle
+#define TIMER_KEY_REPEAT          3     // Time before (and between) BUTTON_HELD events
+#define TIMER_POWER_SWITCH        4     // Ends a pulse on the PWR header pins
+#define TIMER_RESET_SWITCH        5     // Ends a pulse on the RST header pins
+#define TIMER_AUX_SWITCH          6     // Ends a pulse on the AUX header pins
+#define SOFTWARE_TIMERS           7
+volatile unsigned int wTimers[SOFTWARE_TIMERS];
+
+#define ACTIVITY_LED_TICKS        100   // Show the activity LED for 100 ms
+
+// Key repeat is generated in one place for every button: once a button has
+// been held for wKeyRepeatDelayTicks the interrupt handler posts a BUTTON_HELD
+// event for it every KEY_REPEAT_INTERVAL_TICKS (see TIMER_KEY_REPEAT), and
+// nextKeyRepeatStep() turns those events into steps at the configured rate, so
+// every UP/DOWN adjustment and every OK command repeats in exactly the same
+// way. Nothing runs while no button is held. The delay and rate are configured
+// in EEPROM (see loadKeyRepeat).
+#define KEY_REPEAT_UNIT_TICKS     50    // EEPROM key repeat delay is in 50 ms units
+#define DEFAULT_KEY_REPEAT_DELAY  15    // 750 ms
+#define DEFAULT_KEY_REPEAT_RATE   4     // Steps a second
+#define KEY_REPEAT_INTERVAL_TICKS 40    // BUTTON_HELD every 40 ms...
+#define KEY_REPEATS_PER_SECOND    (TICKS_PER_SECOND / KEY_REPEAT_INTERVAL_TICKS) // ...which is 25 a second
+volatile unsigned int wKeyRepeatDelayTicks; // Time before the first BUTTON_HELD event
+byte nKeyRepeatEvents;                 // BUTTON_HELD events per step at the configured rate
+byte nEventsPerKeyRepeat;              // BUTTON_HELD events left before the next step
+
+// The longer UP or DOWN is held, the faster it steps. After a while function
+// codes step by 0x10 and then by 0x100 so that a whole usage page (xyy) can
+// be walked in a few seconds. This only applies to the sparse system control,
+// consumer device and local function pages: on the keyboard page x holds the
+// modifiers, so keyboard codes keep stepping by 1 within yy. Large steps
+// always land on a code ending in 0, which is never skipped, so they work with
+// skipUnnamedCodes(). Every other value just steps by 1 at the faster rates.
+typedef struct
+{
+  unsigned int wHeldTicks;            // Once UP/DOWN has been held this long...
+  byte nEventsPerStep;                // ...step every this many BUTTON_HELD events (at most)...
+  unsigned int wStep;                 // ...by this much (sparse usage pages only)
+} t_repeatStage;
+#define REPEAT_STAGES 5
+const t_repeatStage repeatStages[REPEAT_STAGES] =
+{
+  {0,                     0xFF, 0x001}, // Configured rate (4 steps/sec by default)
+  {2 * TICKS_PER_SECOND,  2,    0x001}, // 12 steps/sec
+  {4 * TICKS_PER_SECOND,  1,    0x001}, // 25 steps/sec
+  {6 * TICKS_PER_SECOND,  2,    0x010}, // 12 x 16 codes/sec
+  {9 * TICKS_PER_SECOND,  2,    0x100}  // 12 x 256 codes/sec
+};
+byte nRepeatStage;                     // repeatStages[] entry in use while OK/UP/DOWN is held
+unsigned int wPressedTicks;            // wTicks when OK/UP/DOWN was pressed
+
+// Buttons are scanned by the interrupt handler: a change on RB4-7 raises an
+// interrupt-on-change, a press on RB0-2 raises INT0-2 (the 18F25K50 has no
+// interrupt-on-change for them) and, while any button is down, every tick
+// rescans the lot to catch releases. Once a change is seen, PORTB is ignored
+// for BUTTON_DEBOUNCE_TICKS while the contacts settle. Each change is queued
+// as a button event for main() to handle, so nothing has to wait for a button
+// to be released.
+#define BUTTON_MASK               0b11110111 // RB3 is the IR receiver
+#define BUTTON_DEBOUNCE_TICKS     30    // ms
+#define BUTTON_TEACH              0     // Button numbers are PORTB bit numbers
+#define BUTTON_CTL                1
+#define BUTTON_ALT                2
+#define BUTTON_SHIFT              4
+#define BUTTON_OK                 5
+#define BUTTON_UP                 6
+#define BUTTON_DOWN               7
+#define NO_BUTTON                 0xFF
+#define BUTTON_NUMBER             0b00000111 // Button event = type | button number
+#define BUTTON_EVENT_TYPE         0b11000000
+#define BUTTON_PRESSED            0b01000000
+#define BUTTON_HELD               0b10000000 // Sent every KEY_REPEAT_INTERVAL_TICKS after wKeyRepeatDelayTicks
+#define BUTTON_RELEASED           0b11000000
+#define BUTTON_EVENT_QUEUE_SIZE   8     // Must be a power of 2
+volatile byte cButtons;                // Debounced button state (1 = pressed)
+volatile byte nHeldButton;             // Button last pressed (for BUTTON_HELD events)
+byte buttonEvents[BUTTON_EVENT_QUEUE_SIZE];
+volatile byte nButtonEventHead;        // Next event to be handled (by main)
+volatile byte nButtonEventTail;        // Next free queue entry (for the interrupt)
+byte nIgnoredButton;                   // Button whose events are ignored until it is released
 
 
 // USB buffers must be in USB RAM, hence the "absolute" specifier...
@@ -689,17 +1006,146 @@ byte BANK4_RESERVED_FOR_USB[256] absolute 0x400; // Prevent compiler from alloca
                                                  // Refer to the PIC18F25K50 datasheet
                                                  // section "6.4.1 USB RAM" for more
                                                  // information.
-byte sUSBResponse[1+1] absolute 0x500;  // Buffer for PIC <-- Host (ReportId + 1 byte)
-byte sUSBCommand[1+3]  absolute 0x508;  // Buffer for PIC --> Host (ReportId + 3 bytes)
+byte sUSBResponse[1+7] absolute 0x500;  // Buffer for PIC <-- Host (ReportId + up to 7 bytes)
+byte sUSBCommand[1+7]  absolute 0x508;  // Buffer for PIC --> Host (ReportId + up to 7 bytes)
+
+// Configuration channel operations (see REPORT_ID_CONFIG in USBdsc.c)...
+#define CONFIG_OP_INFO                'I'   // Return the config image size
+#define CONFIG_OP_READ                'R'   // Read up to 4 EEPROM bytes
+#define CONFIG_OP_WRITE               'W'   // Write up to 4 EEPROM bytes
+#define CONFIG_OP_TELEMETRY           'T'   // Stream telemetry for the next n seconds
+#define CONFIG_MAX_DATA               4     // Data bytes per configuration report
+byte sConfigReport[1+7];                    // Reply to a configuration request
+
+// USB reports waiting to be sent to the host. Reports are queued so that the
+// IR and front panel paths never wait for the host to poll the IN endpoint,
+// and so that a report can be held back while the host is suspended.
+#define USB_QUEUE_SIZE                8     // Number of reports (must be a power of 2)
+#define USB_REPORT_SIZE               4     // Largest queued report (ReportId + 3 bytes)
+byte usbQueue[USB_QUEUE_SIZE][USB_REPORT_SIZE];
+byte usbQueueLength[USB_QUEUE_SIZE];
+byte nUSBQueueHead;                         // Next report to be sent
+byte nUSBQueueTail;                         // Next free queue entry
+#define USB_QUEUE_DEPTH ((nUSBQueueTail - nUSBQueueHead) & (USB_QUEUE_SIZE - 1))
+#define USB_QUEUE_FREE  (USB_QUEUE_SIZE - 1 - USB_QUEUE_DEPTH)
+
+#define SYSTEM_CONTROL_WAKE           0x1083  // uxyy of the System Control "Wake" function
+
+// main() is a run-to-completion scheduler. Each pass runs one task and then
+// starts again, and an IR edge is always handled before anything else, so a
+// decoded frame waits for at most one task before its USB report is queued
+// (and then the USB task runs next). USB and the user interface take turns.
+#define TASK_INFRARED                 0     // Decode the last IR edge
+#define TASK_USB                      1     // Host requests, reports, telemetry and power
+#define TASK_UI                       2     // Button events and LCD
+#define TASKS                         3
+byte nLastTask;                             // Task run by the previous pass
+
+// Telemetry reports (see REPORT_ID_TELEMETRY in USBdsc.c). Telemetry is only
+// gathered and sent while a host reader keeps renewing its request, so that
+// it costs nothing more than a flag test when nobody is listening.
+byte sTelemetryReport[1+7];                 // Telemetry report being sent
+byte nTelemetryPending;                     // Records waiting to be sent...
+#define TELEMETRY_FRAME               0x01  // ...last IR frame received
+#define TELEMETRY_RESULT              0x02  // ...outcome of decoding that frame
+#define TELEMETRY_RESETS              0x04  // ...decoder reset reason counts
+#define TELEMETRY_USB                 0x08  // ...USB queue statistics
+#define TELEMETRY_TASKS               0x10  // ...scheduler task run times
+#define TELEMETRY_INTERRUPTS          0x20  // ...interrupt_low() run times and IR capture delay
+#define TELEMETRY_IDLE                0x40  // ...time the main loop spent idle
+byte sTelemetryFrame[6];                    // Copy of the last IR frame received
+byte nTelemetryOutcome;                     // FRAME_xxx outcome of that frame
+unsigned int wTelemetryResetCount;          // nResetCount when it was received
+unsigned int wTelemetryPulseWidth;          // Width of its last pulse (Timer1 ticks)
+unsigned int wUSBBusyCount;                 // Times the host had not yet collected the last report
+unsigned int wUSBDroppedCount;              // Reports dropped (queue full or host suspended)
+unsigned int wTaskLongestRun[TASKS];        // Longest run of each task (Timer3 counts)
+volatile unsigned int wISRLongestRun;       // Longest run of interrupt_low() (Timer3 counts)
+volatile unsigned long ulISRTotalRun;       // Total run of interrupt_low()...
+volatile unsigned int wISRCount;            // ...over this many interrupts
+volatile unsigned int wLongestCaptureDelay; // Longest IR edge to CCP2 service (Timer1 counts)
+unsigned long ulIdleTotal;                  // Time spent in Idle mode (Timer3 counts)...
+unsigned int wIdleCount;                    // ...over this many waits...
+unsigned int wIdleSinceTicks;               // ...since this wTicks
+byte nTelemetryLeaseSeconds;                // How much longer the host wants telemetry for
+unsigned int wTelemetrySentTicks;           // wTicks when the last telemetry report was sent
+unsigned int wTelemetryStatsTicks;          // wTicks when the last statistics were queued
+#define TELEMETRY_INTERVAL_TICKS      40    // At most one telemetry report every 40 ms...
+#define TELEMETRY_STATS_TICKS         TICKS_PER_SECOND // ...and statistics once a second
+
+// USB enumeration is driven from the main loop by serviceUSB() so that IR
+// commands (in particular the local PWR/RST switch functions), the front panel
+// and the backlight keep working while the host is off or still booting.
+byte nUSBState;
+#define USB_STATE_DETACHED            0     // No USB power
+#define USB_STATE_ENABLING            1     // Waiting for the host to enumerate IRK!
+#define USB_STATE_RETRY_WAIT          2     // Enumeration timed out, waiting to retry
+#define USB_STATE_READY               3     // Enumerated, reports can be sent
+unsigned int wUSBStateTicks;                // wTicks when the current state was entered
+unsigned int wUSBPollTicks;                 // wTicks when the host was last polled
+#define USB_POLL_TICKS                (TICKS_PER_SECOND / 10)  // Try to send every 100 ms...
+#define USB_ENABLE_TIMEOUT_TICKS      (5 * TICKS_PER_SECOND)   // ...for up to 5 seconds...
+#define USB_RETRY_DELAY_TICKS         (5 * TICKS_PER_SECOND)   // ...then wait 5 seconds and retry
+
+// The MikroC HID library answers SET_FEATURE(DEVICE_REMOTE_WAKEUP) itself without
+// telling the application, so interrupt_low() looks at each SETUP packet before
+// the library does (see watchSetupPacket). A device may only signal resume once
+// the host has enabled remote wakeup and the bus has been idle for at least 5 ms
+// (USB 2.0 section 7.1.7.7). IDLEIF fires after 3 ms, so wait 2 ms more.
+unsigned int wSuspendTicks;                 // wTicks when the host suspended the bus
+#define USB_RESUME_IDLE_TICKS         2     // Further idle time needed before resume signalling
+#define USB_PID_SETUP                 0x0D  // Buffer descriptor PID of a SETUP token
+#define USB_REQUEST_CLEAR_FEATURE     0x01
+#define USB_REQUEST_SET_FEATURE       0x03
+#define USB_FEATURE_REMOTE_WAKEUP     0x01  // DEVICE_REMOTE_WAKEUP feature selector
+
+// Prolog() brings up IR capture and USB before the LCD, so that IRK! can send
+// keystrokes as soon as possible after power up. The end of each boot phase is
+// recorded (in ms since the system tick started) and shown in debug mode once
+// USB is first ready (see showBootTimes).
+#define BOOT_PHASE_USB                0     // IR capture enabled and USB attached
+#define BOOT_PHASE_LCD                1     // LCD initialised
+#define BOOT_PHASE_READY              2     // Enumerated, ready to send keystrokes
+#define BOOT_PHASES                   3
+unsigned int wBootTicks[BOOT_PHASES];
 
 #define LCD_WIDTH 16
 char sLCDLine1[LCD_WIDTH+1];
 char sLCDLine2[LCD_WIDTH+1];
+char sLCDShadow[2][LCD_WIDTH];  // What is currently on each LCD line
+byte nLCDCursor;                // LCD address (_LCD_FIRST_ROW + column) the next character goes to
+
+// LCD writes are queued and sent to the LCD one 4-bit nibble per Timer2
+// interrupt, so that updating the display never waits for the LCD. Timer2 is
+// already running at the IR modulation frequency for the PWM module, so its
+// postscaler is used to slow its interrupts down to a pace the LCD can keep up
+// with (38 kHz / 4 = one nibble every 105 us, the LCD needs 37 us per byte).
+#define LCD_QUEUE_SIZE                64    // Number of bytes (must be a power of 2, and hold
+                                            // ...a full redraw: 32 characters + 2 cursor moves)
+#define LCD_INSTRUCTION               0x00  // Queued before each instruction byte (show CGRAM 0 as 0x08)
+#define LCD_SLOW_INSTRUCTION_TICKS    16    // Clear and Home take 1.52 ms (16 x 105 us)
+#define LCD_TIMER2_POSTSCALE          0b00011000 // T2OUTPS = 1:4
+char cLCDQueue[LCD_QUEUE_SIZE];
+volatile byte nLCDQueueHead;                // Next byte to be sent (by the interrupt)
+volatile byte nLCDQueueTail;                // Next free queue entry
+volatile byte nLCDWaitTicks;                // Timer2 interrupts left before the LCD is ready
+char cLCDNibble;                            // Byte being sent, shifted for its low nibble
+volatile byte cLCDFlags;
+#define bLCDLowNibble                 cLCDFlags.B0  // High nibble has been sent
+#define bLCDInstruction               cLCDFlags.B1  // Byte being sent is an instruction
+#define bLCDUpdatePending             cLCDFlags.B2  // Display needs to be redrawn
+
+// Redrawing the display is lazy: updateLCD() only marks the display as out of
+// date and serviceLCD() redraws it at most LCD_REFRESH_RATE_IN_HZ times a second,
+// so a burst of IR frames or a held button costs one redraw per refresh period
+// and the last state is always shown
+#define LCD_REFRESH_RATE_IN_HZ        10
+#define LCD_REFRESH_TICKS             (TICKS_PER_SECOND / LCD_REFRESH_RATE_IN_HZ)
+unsigned int wLCDRefreshTicks;              // wTicks when the display was last redrawn
 
 byte nBit;
 byte cByte;
 byte nByte;
-int  nActivityLEDDelay;  // LED delay in units of "main loop iterations"
 
 // The command sent/received using Infrared...
 union
@@ -732,311 +1178,470 @@ union
 #define USAGE_CONSUMER_DEVICE      0x20
 #define USAGE_LOCAL_IRK_FUNCTION   0xF0
 
-const char * pUnshiftedKey;
-const char * pShiftedKey;
+// Text literals stay in ROM and are copied character by character straight
+// into the LCD line buffers (or onto the LCD) as they are needed (saves RAM)
+void appendText(char * s, const char * p)  // Like strcat(s,p) but p is in ROM
+{
+  byte n;
+  n = strlen(s);
+  s += n;
+  while (*p && n++ < LCD_WIDTH)      // Never overflow an LCD line
+    *s++ = *p++;
+  *s = 0;
+}
 
-// Copies a text string from ROM into a RAM buffer (saves RAM)
-char * _TEXT(const char * p)
+void copyText(char * s, const char * p)    // Like strcpy(s,p) but p is in ROM
 {
-  static char sText[32];
-  char * q;
-  for (q=&sText; *q++ = *p++; );
-  return &sText;
+  *s = 0;
+  appendText(s, p);
 }
 
 
+void startTimer(byte nTimer, unsigned int wDuration) // In ticks, 0 stops the timer (not for use by interrupt_low())
+{
+  byte bLowEnabled;
+  bLowEnabled = PEIE_bit;   // The caller may already have interrupt_low() disabled
+  PEIE_bit = 0;             // Stop interrupt_low() updating the timer while we write both bytes
+  wTimers[nTimer] = wDuration;
+  if (wDuration)
+    TMR0ON_bit = 1;         // The tick may have stopped itself (see enterLowPowerMode)
+  PEIE_bit = bLowEnabled;
+}
+
 void actionBacklightDelay ()
 {
   switch (nConfigBacklightDelay)
   {
    case 0x00:                  // Backlight always OFF
      LCD_BACKLIGHT = 1;        // Set LCD backlight off (0=On, 1=Off)
-     TMR0ON_bit = 0;           // Disable the backlight timer
+     startTimer(TIMER_BACKLIGHT, 0);  // Stop the backlight timer
      break;
    case 0xFF:                  // Backlight always ON
      LCD_BACKLIGHT = 0;        // Set LCD backlight on (0=On, 1=Off)
-     TMR0ON_bit = 0;           // Disable the backlight timer
+     startTimer(TIMER_BACKLIGHT, 0);  // Stop the backlight timer
      break;
    default:                    // Backlight off after nn seconds
-     TMR0ON_bit = 1;           // Enable the backlight timer
+     if (nBacklightDelay > 0)
+       startTimer(TIMER_BACKLIGHT, TICKS_PER_SECOND); // Resume the countdown
      break;
   }
 }
 
 void loadBacklightDelay ()
 {
-  nConfigBacklightDelay = EEPROM_Read(1);   // Backlight on for nn seconds
+  nConfigBacklightDelay = EEPROM_Read(EEPROM_BACKLIGHT_DELAY);   // Backlight on for nn seconds
   actionBacklightDelay();
 }
 
 void saveBacklightDelay ()
 {
-  EEPROM_Write(1, nConfigBacklightDelay);
+  EEPROM_Write(EEPROM_BACKLIGHT_DELAY, nConfigBacklightDelay);
   actionBacklightDelay();
 }
 
-const char * getKeyWithNoShift () // Note: Literals returned as const are in ROM
-{ // Keyboard key without SHIFT modifier key pressed
-  switch (usbCommand.s.yy)
-  {
-    case 0x04: return "a";             //   4  04  a A
-    case 0x05: return "b";             //   5  05  b B
-    case 0x06: return "c";             //   6  06  c C
-    case 0x07: return "d";             //   7  07  d D
-    case 0x08: return "e";             //   8  08  e E
-    case 0x09: return "f";             //   9  09  f F
-    case 0x0A: return "g";             //  10  0A  g G
-    case 0x0B: return "h";             //  11  0B  h H
-    case 0x0C: return "i";             //  12  0C  i I
-    case 0x0D: return "j";             //  13  0D  j J
-    case 0x0E: return "k";             //  14  0E  k K
-    case 0x0F: return "l";             //  15  0F  l L
-    case 0x10: return "m";             //  16  10  m M
-    case 0x11: return "n";             //  17  11  n N
-    case 0x12: return "o";             //  18  12  o O
-    case 0x13: return "p";             //  19  13  p P
-    case 0x14: return "q";             //  20  14  q Q
-    case 0x15: return "r";             //  21  15  r R
-    case 0x16: return "s";             //  22  16  s S
-    case 0x17: return "t";             //  23  17  t T
-    case 0x18: return "u";             //  24  18  u U
-    case 0x19: return "v";             //  25  19  v V
-    case 0x1A: return "w";             //  26  1A  w W
-    case 0x1B: return "x";             //  27  1B  x X
-    case 0x1C: return "y";             //  28  1C  y Y
-    case 0x1D: return "z";             //  29  1D  z Z
-    case 0x1E: return "1";             //  30  1E  1 !
-    case 0x1F: return "2";             //  31  1F  2 @
-    case 0x20: return "3";             //  32  20  3 #
-    case 0x21: return "4";             //  33  21  4 $
-    case 0x22: return "5";             //  34  22  5 %
-    case 0x23: return "6";             //  35  23  6 ^
-    case 0x24: return "7";             //  36  24  7 &
-    case 0x25: return "8";             //  37  25  8 *
-    case 0x26: return "9";             //  38  26  9 (
-    case 0x27: return "0";             //  39  27  0 )
-    case 0x28: return "Enter";         //  40  28  Enter
-    case 0x29: return "Esc";           //  41  29  Escape
-    case 0x2A: return "Backspace";     //  42  2A  Backspace
-    case 0x2B: return "Tab";           //  43  2B  Tab
-    case 0x2C: return "Spacebar";      //  44  2C  Spacebar
-    case 0x2D: return "-";             //  45  2D  - _
-    case 0x2E: return "=";             //  46  2E  = +
-    case 0x2F: return "[";             //  47  2F  [ {
-    case 0x30: return "]";             //  48  30  ] }
-    case 0x31: return "\7";            //  49  31  \ |   (character generator)
-                                       //  50  32  Non-US # Non-US ~
-    case 0x33: return ";";             //  51  33  ; :
-    case 0x34: return "\'";            //  52  34   "
-    case 0x35: return "`";             //  53  35  ` ~
-    case 0x36: return ",";             //  54  36  , <
-    case 0x37: return ".";             //  55  37  . >
-    case 0x38: return "/";             //  56  38  / ?
-    case 0x39: return "Caps Lock";     //  57  39  Caps lock
-    case 0x3A: return "F1";            //  58  3A  F1
-    case 0x3B: return "F2";            //  59  3B  F2
-    case 0x3C: return "F3";            //  60  3C  F3
-    case 0x3D: return "F4";            //  61  3D  F4
-    case 0x3E: return "F5";            //  62  3E  F5
-    case 0x3F: return "F6";            //  63  3F  F6
-    case 0x40: return "F7";            //  64  40  F7
-    case 0x41: return "F8";            //  65  41  F8
-    case 0x42: return "F9";            //  66  42  F9
-    case 0x43: return "F10";           //  67  43  F10
-    case 0x44: return "F11";           //  68  44  F11
-    case 0x45: return "F12";           //  69  45  F12
-    case 0x46: return "Print Screen";  //  70  46  Print Screen
-    case 0x47: return "Scroll Lock";   //  71  47  Scroll Lock
-    case 0x48: return "\6";            //  72  48  Pause (character generator)
-    case 0x49: return "Insert";        //  73  49  Insert
-    case 0x4A: return "Home";          //  74  4A  Home
-    case 0x4B: return "Page Up";       //  75  4B  Page Up
-    case 0x4C: return "Delete";        //  76  4C  Delete
-    case 0x4D: return "End";           //  77  4D  End
-    case 0x4E: return "Page Down";     //  78  4E  Page Down
-    case 0x4F: return "\3";            //  79  4F  Right (character generator)
-    case 0x50: return "\4";            //  80  50  Left  (character generator)
-    case 0x51: return "\2";            //  81  51  Down  (character generator)
-    case 0x52: return "\1";            //  82  52  Up    (character generator)
-    case 0x53: return "Num Lock";      //  83  53  Keypad Num Lock Clear
-
-    case 0x54: return "Keypad /";      //  84  54  Keypad /
-    case 0x55: return "Keypad *";      //  85  55  Keypad *
-    case 0x56: return "Keypad -";      //  86  56  Keypad -
-    case 0x57: return "Keypad +";      //  87  57  Keypad +
-    case 0x58: return "Keypad Enter";  //  88  58  Keypad Enter
-    case 0x59: return "Keypad 1";      //  89  59  Keypad 1 End
-    case 0x5A: return "Keypad 2";      //  90  5A  Keypad 2 Down
-    case 0x5B: return "Keypad 3";      //  91  5B  Keypad 3 PgDn
-    case 0x5C: return "Keypad 4";      //  92  5C  Keypad 4 Left
-    case 0x5D: return "Keypad 5";      //  93  5D  Keypad 5
-    case 0x5E: return "Keypad 6";      //  94  5E  Keypad 6 Right
-    case 0x5F: return "Keypad 7";      //  95  5F  Keypad 7 Home
-    case 0x60: return "Keypad 8";      //  96  60  Keypad 8 Up
-    case 0x61: return "Keypad 9";      //  97  61  Keypad 9 PgUp
-    case 0x62: return "Keypad 0";      //  98  62  Keypad 0 Ins
-    case 0x63: return "Keypad .";      //  99  63  Keypad . Del
-                                       //  100 64  Non-US \ |
-                                       //  101 65  Application
-                                       //  102 66  Power
-    case 0x67: return "Keypad =";      //  103 67  Keypad =
-    case 0x68: return "F13";           //  104 68  F13
-    case 0x69: return "F14";           //  105 69  F14
-    case 0x6A: return "F15";           //  106 6A  F15
-    case 0x6B: return "F16";           //  107 6B  F16
-    case 0x6C: return "F17";           //  108 6C  F17
-    case 0x6D: return "F18";           //  109 6D  F18
-    case 0x6E: return "F19";           //  110 6E  F19
-    case 0x6F: return "F20";           //  111 6F  F20
-    case 0x70: return "F21";           //  112 70  F21
-    case 0x71: return "F22";           //  113 71  F22
-    case 0x72: return "F23";           //  114 72  F23
-    case 0x73: return "F24";           //  115 73  F24
+void loadKeyRepeat ()
+{
+  byte nDelay;
+  byte nRate;
+  nDelay = EEPROM_Read(EEPROM_KEY_REPEAT_DELAY);
+  if (nDelay == 0x00 || nDelay == 0xFF) // If not configured
+    nDelay = DEFAULT_KEY_REPEAT_DELAY;
+  nRate = EEPROM_Read(EEPROM_KEY_REPEAT_RATE);
+  if (nRate == 0x00 || nRate == 0xFF)
+    nRate = DEFAULT_KEY_REPEAT_RATE;
+  if (nRate > KEY_REPEATS_PER_SECOND)   // BUTTON_HELD events cannot come any faster
+    nRate = KEY_REPEATS_PER_SECOND;
+  nKeyRepeatEvents = KEY_REPEATS_PER_SECOND / nRate;
+  GIE_bit = 0;                          // interrupt_low() reads it
+  wKeyRepeatDelayTicks = (unsigned int)nDelay * KEY_REPEAT_UNIT_TICKS;
+  GIE_bit = 1;
+}
 
-    default: return "";
-  }
+void loadOptions ()
+{
+  nConfigOptions = EEPROM_Read(EEPROM_OPTIONS);
+  if (nConfigOptions == 0xFF)   // If the options byte has never been written
+    nConfigOptions = 0x00;      // Then use the default options
+  bDebugMode = (nConfigOptions & OPTION_DEBUG_MODE) != 0;
 }
 
-const char * getKeyWithShift() // Note: Literals returned as const are in ROM
-{ // Keyboard key with SHIFT modifier key pressed
-  switch (usbCommand.s.yy)
-  {
-    case 0x04: return "A";             //   4  04  a A
-    case 0x05: return "B";             //   5  05  b B
-    case 0x06: return "C";             //   6  06  c C
-    case 0x07: return "D";             //   7  07  d D
-    case 0x08: return "E";             //   8  08  e E
-    case 0x09: return "F";             //   9  09  f F
-    case 0x0A: return "G";             //  10  0A  g G
-    case 0x0B: return "H";             //  11  0B  h H
-    case 0x0C: return "I";             //  12  0C  i I
-    case 0x0D: return "J";             //  13  0D  j J
-    case 0x0E: return "K";             //  14  0E  k K
-    case 0x0F: return "L";             //  15  0F  l L
-    case 0x10: return "M";             //  16  10  m M
-    case 0x11: return "N";             //  17  11  n N
-    case 0x12: return "O";             //  18  12  o O
-    case 0x13: return "P";             //  19  13  p P
-    case 0x14: return "Q";             //  20  14  q Q
-    case 0x15: return "R";             //  21  15  r R
-    case 0x16: return "S";             //  22  16  s S
-    case 0x17: return "T";             //  23  17  t T
-    case 0x18: return "U";             //  24  18  u U
-    case 0x19: return "V";             //  25  19  v V
-    case 0x1A: return "W";             //  26  1A  w W
-    case 0x1B: return "X";             //  27  1B  x X
-    case 0x1C: return "Y";             //  28  1C  y Y
-    case 0x1D: return "Z";             //  29  1D  z Z
-    case 0x1E: return "!";             //  30  1E  1 !
-    case 0x1F: return "@";             //  31  1F  2 @
-    case 0x20: return "#";             //  32  20  3 #
-    case 0x21: return "$";             //  33  21  4 $
-    case 0x22: return "%";             //  34  22  5 %
-    case 0x23: return "^";             //  35  23  6 ^
-    case 0x24: return "&";             //  36  24  7 &
-    case 0x25: return "*";             //  37  25  8 *
-    case 0x26: return "(";             //  38  26  9 (
-    case 0x27: return ")";             //  39  27  0 )
-
-    case 0x2D: return "_";             //  45  2D  - _
-    case 0x2E: return "+";             //  46  2E  = +
-    case 0x2F: return "{";             //  47  2F  [ {
-    case 0x30: return "}";             //  48  30  ] }
-    case 0x31: return "|";             //  49  31  \ |
-                                       //  50  32  Non-US # Non-US ~
-    case 0x33: return ":";             //  51  33  ; :
-    case 0x34: return "\"";            //  52  34   "
-    case 0x35: return "\5";            //  53  35  ` ~  (character generator)
-    case 0x36: return "<";             //  54  36  , <
-    case 0x37: return ">";             //  55  37  . >
-    case 0x38: return "?";             //  56  38  / ?
-
-    case 0x59: return "Keypad End";    //  89  59  Keypad 1 End
-    case 0x5A: return "Keypad Down";   //  90  5A  Keypad 2 Down
-    case 0x5B: return "Keypad PgDn";   //  91  5B  Keypad 3 PgDn
-    case 0x5C: return "Keypad Left";   //  92  5C  Keypad 4 Left
-                                       //  93  5D  Keypad 5
-    case 0x5E: return "Keypad Right";  //  94  5E  Keypad 6 Right
-    case 0x5F: return "Keypad Home";   //  95  5F  Keypad 7 Home
-    case 0x60: return "Keypad Up";     //  96  60  Keypad 8 Up
-    case 0x61: return "Keypad PgUp";   //  97  61  Keypad 9 PgUp
-    case 0x62: return "Keypad Insert"; //  98  62  Keypad 0 Ins
-    case 0x63: return "Keypad Delete"; //  99  63  Keypad . Del
-                                       //  100 64  Non-US \ |
+void loadConfig ()
+{
+  nConfigDeviceAddress = EEPROM_Read(EEPROM_DEVICE_ADDRESS);  // This IRK! device's IR address
+  loadBacklightDelay();
+  loadOptions();
+  loadKeyRepeat();
+}
 
-    default: return "";
+#define IS_CONFIG_WRITTEN(a) ((a) >= wAddress && (a) < wAddress + nLength)
+
+void reloadConfig (unsigned int wAddress, byte nLength) // After the host has written these EEPROM bytes
+{ // Only what was written is reloaded, so that e.g. an IR "Debug On" survives a backlight change
+  if (IS_CONFIG_WRITTEN(EEPROM_DEVICE_ADDRESS))
+    nConfigDeviceAddress = EEPROM_Read(EEPROM_DEVICE_ADDRESS);
+  if (IS_CONFIG_WRITTEN(EEPROM_BACKLIGHT_DELAY))
+    loadBacklightDelay();
+  if (IS_CONFIG_WRITTEN(EEPROM_OPTIONS))
+    loadOptions();
+  if (IS_CONFIG_WRITTEN(EEPROM_KEY_REPEAT_DELAY) || IS_CONFIG_WRITTEN(EEPROM_KEY_REPEAT_RATE))
+    loadKeyRepeat();
+  // Switch pulse lengths are read from EEPROM each time they are used
+}
+
+// Names of the USB functions, held in ROM tables rather than switch statements
+// so that finding a name takes a single lookup instead of a chain of compares.
+// The keyboard page and the IRK! local functions are indexed directly by their
+// usage code (yy). The system control and consumer device pages are sparse, so
+// they are kept sorted by uxyy and searched with a binary search.
+// An empty name means that IRK! has no name for that function.
+#define KEYBOARD_NAMES                116   // Keyboard codes 0x00 to 0x73 have names
+#define SHIFTED_KEYBOARD_NAMES        100   // Keyboard codes 0x00 to 0x63 can have SHIFT names
+
+const char * const sKeyNames[KEYBOARD_NAMES] =   // Keyboard key without SHIFT modifier key pressed
+{
+  "",              //   0  00
+  "",              //   1  01
+  "",              //   2  02
+  "",              //   3  03
+  "a",             //   4  04  a A
+  "b",             //   5  05  b B
+  "c",             //   6  06  c C
+  "d",             //   7  07  d D
+  "e",             //   8  08  e E
+  "f",             //   9  09  f F
+  "g",             //  10  0A  g G
+  "h",             //  11  0B  h H
+  "i",             //  12  0C  i I
+  "j",             //  13  0D  j J
+  "k",             //  14  0E  k K
+  "l",             //  15  0F  l L
+  "m",             //  16  10  m M
+  "n",             //  17  11  n N
+  "o",             //  18  12  o O
+  "p",             //  19  13  p P
+  "q",             //  20  14  q Q
+  "r",             //  21  15  r R
+  "s",             //  22  16  s S
+  "t",             //  23  17  t T
+  "u",             //  24  18  u U
+  "v",             //  25  19  v V
+  "w",             //  26  1A  w W
+  "x",             //  27  1B  x X
+  "y",             //  28  1C  y Y
+  "z",             //  29  1D  z Z
+  "1",             //  30  1E  1 !
+  "2",             //  31  1F  2 @
+  "3",             //  32  20  3 #
+  "4",             //  33  21  4 $
+  "5",             //  34  22  5 %
+  "6",             //  35  23  6 ^
+  "7",             //  36  24  7 &
+  "8",             //  37  25  8 *
+  "9",             //  38  26  9 (
+  "0",             //  39  27  0 )
+  "Enter",         //  40  28  Enter
+  "Esc",           //  41  29  Escape
+  "Backspace",     //  42  2A  Backspace
+  "Tab",           //  43  2B  Tab
+  "Spacebar",      //  44  2C  Spacebar
+  "-",             //  45  2D  - _
+  "=",             //  46  2E  = +
+  "[",             //  47  2F  [ {
+  "]",             //  48  30  ] }
+  "\7",            //  49  31  \ |   (character generator)
+  "",              //  50  32  Non-US # Non-US ~
+  ";",             //  51  33  ; :
+  "\'",            //  52  34   "
+  "`",             //  53  35  ` ~
+  ",",             //  54  36  , <
+  ".",             //  55  37  . >
+  "/",             //  56  38  / ?
+  "Caps Lock",     //  57  39  Caps lock
+  "F1",            //  58  3A  F1
+  "F2",            //  59  3B  F2
+  "F3",            //  60  3C  F3
+  "F4",            //  61  3D  F4
+  "F5",            //  62  3E  F5
+  "F6",            //  63  3F  F6
+  "F7",            //  64  40  F7
+  "F8",            //  65  41  F8
+  "F9",            //  66  42  F9
+  "F10",           //  67  43  F10
+  "F11",           //  68  44  F11
+  "F12",           //  69  45  F12
+  "Print Screen",  //  70  46  Print Screen
+  "Scroll Lock",   //  71  47  Scroll Lock
+  "\6",            //  72  48  Pause (character generator)
+  "Insert",        //  73  49  Insert
+  "Home",          //  74  4A  Home
+  "Page Up",       //  75  4B  Page Up
+  "Delete",        //  76  4C  Delete
+  "End",           //  77  4D  End
+  "Page Down",     //  78  4E  Page Down
+  "\3",            //  79  4F  Right (character generator)
+  "\4",            //  80  50  Left  (character generator)
+  "\2",            //  81  51  Down  (character generator)
+  "\1",            //  82  52  Up    (character generator)
+  "Num Lock",      //  83  53  Keypad Num Lock Clear
+  "Keypad /",      //  84  54  Keypad /
+  "Keypad *",      //  85  55  Keypad *
+  "Keypad -",      //  86  56  Keypad -
+  "Keypad +",      //  87  57  Keypad +
+  "Keypad Enter",  //  88  58  Keypad Enter
+  "Keypad 1",      //  89  59  Keypad 1 End
+  "Keypad 2",      //  90  5A  Keypad 2 Down
+  "Keypad 3",      //  91  5B  Keypad 3 PgDn
+  "Keypad 4",      //  92  5C  Keypad 4 Left
+  "Keypad 5",      //  93  5D  Keypad 5
+  "Keypad 6",      //  94  5E  Keypad 6 Right
+  "Keypad 7",      //  95  5F  Keypad 7 Home
+  "Keypad 8",      //  96  60  Keypad 8 Up
+  "Keypad 9",      //  97  61  Keypad 9 PgUp
+  "Keypad 0",      //  98  62  Keypad 0 Ins
+  "Keypad .",      //  99  63  Keypad . Del
+  "",              //  100 64  Non-US \ |
+  "",              //  101 65  Application
+  "",              //  102 66  Power
+  "Keypad =",      //  103 67  Keypad =
+  "F13",           //  104 68  F13
+  "F14",           //  105 69  F14
+  "F15",           //  106 6A  F15
+  "F16",           //  107 6B  F16
+  "F17",           //  108 6C  F17
+  "F18",           //  109 6D  F18
+  "F19",           //  110 6E  F19
+  "F20",           //  111 6F  F20
+  "F21",           //  112 70  F21
+  "F22",           //  113 71  F22
+  "F23",           //  114 72  F23
+  "F24"            //  115 73  F24
+};
+
+const char * const sShiftedKeyNames[SHIFTED_KEYBOARD_NAMES] = // Keyboard key with SHIFT modifier key pressed
+{ // An empty name means the name does not change when SHIFT is pressed
+  "",              //   0  00
+  "",              //   1  01
+  "",              //   2  02
+  "",              //   3  03
+  "A",             //   4  04  a A
+  "B",             //   5  05  b B
+  "C",             //   6  06  c C
+  "D",             //   7  07  d D
+  "E",             //   8  08  e E
+  "F",             //   9  09  f F
+  "G",             //  10  0A  g G
+  "H",             //  11  0B  h H
+  "I",             //  12  0C  i I
+  "J",             //  13  0D  j J
+  "K",             //  14  0E  k K
+  "L",             //  15  0F  l L
+  "M",             //  16  10  m M
+  "N",             //  17  11  n N
+  "O",             //  18  12  o O
+  "P",             //  19  13  p P
+  "Q",             //  20  14  q Q
+  "R",             //  21  15  r R
+  "S",             //  22  16  s S
+  "T",             //  23  17  t T
+  "U",             //  24  18  u U
+  "V",             //  25  19  v V
+  "W",             //  26  1A  w W
+  "X",             //  27  1B  x X
+  "Y",             //  28  1C  y Y
+  "Z",             //  29  1D  z Z
+  "!",             //  30  1E  1 !
+  "@",             //  31  1F  2 @
+  "#",             //  32  20  3 #
+  "$",             //  33  21  4 $
+  "%",             //  34  22  5 %
+  "^",             //  35  23  6 ^
+  "&",             //  36  24  7 &
+  "*",             //  37  25  8 *
+  "(",             //  38  26  9 (
+  ")",             //  39  27  0 )
+  "",              //  40  28  Enter
+  "",              //  41  29  Escape
+  "",              //  42  2A  Backspace
+  "",              //  43  2B  Tab
+  "",              //  44  2C  Spacebar
+  "_",             //  45  2D  - _
+  "+",             //  46  2E  = +
+  "{",             //  47  2F  [ {
+  "}",             //  48  30  ] }
+  "|",             //  49  31  \ |
+  "",              //  50  32  Non-US # Non-US ~
+  ":",             //  51  33  ; :
+  "\"",            //  52  34   "
+  "\5",            //  53  35  ` ~  (character generator)
+  "<",             //  54  36  , <
+  ">",             //  55  37  . >
+  "?",             //  56  38  / ?
+  "",              //  57  39  Caps lock
+  "",              //  58  3A  F1
+  "",              //  59  3B  F2
+  "",              //  60  3C  F3
+  "",              //  61  3D  F4
+  "",              //  62  3E  F5
+  "",              //  63  3F  F6
+  "",              //  64  40  F7
+  "",              //  65  41  F8
+  "",              //  66  42  F9
+  "",              //  67  43  F10
+  "",              //  68  44  F11
+  "",              //  69  45  F12
+  "",              //  70  46  Print Screen
+  "",              //  71  47  Scroll Lock
+  "",              //  72  48  Pause (character generator)
+  "",              //  73  49  Insert
+  "",              //  74  4A  Home
+  "",              //  75  4B  Page Up
+  "",              //  76  4C  Delete
+  "",              //  77  4D  End
+  "",              //  78  4E  Page Down
+  "",              //  79  4F  Right (character generator)
+  "",              //  80  50  Left  (character generator)
+  "",              //  81  51  Down  (character generator)
+  "",              //  82  52  Up    (character generator)
+  "",              //  83  53  Keypad Num Lock Clear
+  "",              //  84  54  Keypad /
+  "",              //  85  55  Keypad *
+  "",              //  86  56  Keypad -
+  "",              //  87  57  Keypad +
+  "",              //  88  58  Keypad Enter
+  "Keypad End",    //  89  59  Keypad 1 End
+  "Keypad Down",   //  90  5A  Keypad 2 Down
+  "Keypad PgDn",   //  91  5B  Keypad 3 PgDn
+  "Keypad Left",   //  92  5C  Keypad 4 Left
+  "",              //  93  5D  Keypad 5
+  "Keypad Right",  //  94  5E  Keypad 6 Right
+  "Keypad Home",   //  95  5F  Keypad 7 Home
+  "Keypad Up",     //  96  60  Keypad 8 Up
+  "Keypad PgUp",   //  97  61  Keypad 9 PgUp
+  "Keypad Insert", //  98  62  Keypad 0 Ins
+  "Keypad Delete"  //  99  63  Keypad . Del
+};
+
+typedef struct
+{
+  unsigned int uxyy;                  // Usage code (must be in ascending order)
+  const char * pName;
+} t_usageName;
+
+#define SYSTEM_CONTROL_NAMES          3
+const t_usageName systemControlNames[SYSTEM_CONTROL_NAMES] =
+{
+  {0x1081, "Power off"},
+  {0x1082, "Sleep"},
+  {0x1083, "Wake"}
+};
+
+#define CONSUMER_DEVICE_NAMES         37
+const t_usageName consumerDeviceNames[CONSUMER_DEVICE_NAMES] =
+{
+  {0x2040, "Menu"},                   // Menu (on/off)
+  {0x2041, "Menu Pick"},              // Menu Pick
+  {0x2042, "Menu \1"},                // Menu Up
+  {0x2043, "Menu \2"},                // Menu Down
+  {0x2044, "Menu \4"},                // Menu Left
+  {0x2045, "Menu \3"},                // Menu Right
+  {0x2046, "Menu Exit"},              // Menu Escape
+  {0x2047, "Menu +"},                 // Menu Value Increase
+  {0x2048, "Menu -"},                 // Menu Value Decrease
+  {0x209C, "Ch+"},                    // Channel Up
+  {0x209D, "Ch-"},                    // Channel Down
+  {0x20B0, ">"},                      // Play
+  {0x20B1, "\6"},                     // Pause
+  {0x20B2, "Rec"},                    // Record
+  {0x20B3, ">>"},                     // Fast Forward
+  {0x20B4, "<<"},                     // Rewind
+  {0x20B5, ">>|"},                    // Next Track
+  {0x20B6, "|<<"},                    // Previous Track
+  {0x20B7, "Stop"},                   // Stop
+  {0x20B8, "Eject"},                  // Eject
+  {0x20CD, ">/\6"},                   // Play / Pause
+  {0x20E2, "Mute"},                   // Mute
+  {0x20E9, "Vol+"},                   // Volume Up
+  {0x20EA, "Vol-"},                   // Volume Down
+  {0x2183, "Media Player"},           // Application: Consumer Control Configuration
+  {0x2185, "Text Editor"},            // Application: Text Editor
+  {0x218A, "Email"},                  // Application: Email
+  {0x2192, "Calculator"},             // Application: Calculator
+  {0x2194, "Computer"},               // Application: Local Machine Browser
+  {0x2196, "Web Browser"},            // Application: Web Browser
+  {0x2221, "Web Search"},             // Browser: Search
+  {0x2223, "Web Home"},               // Browser: Home
+  {0x2224, "Web Prev"},               // Browser: Back
+  {0x2225, "Web Next"},               // Browser: Next
+  {0x2226, "Web Stop"},               // Browser: Stop
+  {0x2227, "Web Refresh"},            // Browser: Reload
+  {0x222A, "Web Bookmarks"}           // Browser: Bookmarks
+};
+
+#define LOCAL_FUNCTION_NAMES          17
+const char * const sLocalFunctionNames[LOCAL_FUNCTION_NAMES] =
+{
+  "Set Address",                      // CMD_SET_DEVICE_ADDRESS
+  "Power Switch",                     // CMD_PRESS_POWER_SWITCH
+  "Reset Switch",                     // CMD_PRESS_RESET_SWITCH
+  "Init USB",                         // CMD_INIT_USB
+  "Light Off",                        // CMD_SET_BACKLIGHT_OFF   Set delay = 0x00
+  "Light On",                         // CMD_SET_BACKLIGHT_ON    Set delay = 0xFF
+  "Light Delay",                      // CMD_SET_BACKLIGHT_DELAY Set delay = 0x01 to 0xFE (1 to 254 seconds)
+  "Debug On",                         // CMD_SET_DEBUG_ON
+  "Debug Off",                        // CMD_SET_DEBUG_OFF
+  "Aux Switch",                       // CMD_PRESS_AUX_SWITCH
+  "Power Sw On",                      // CMD_POWER_SWITCH_ON
+  "Reset Sw On",                      // CMD_RESET_SWITCH_ON
+  "Aux Sw On",                        // CMD_AUX_SWITCH_ON
+  "Power Sw Off",                     // CMD_POWER_SWITCH_OFF
+  "Reset Sw Off",                     // CMD_RESET_SWITCH_OFF
+  "Aux Sw Off",                       // CMD_AUX_SWITCH_OFF
+  "Power Sw Hold"                     // CMD_HOLD_POWER_SWITCH
+};
+
+const char * findUsageName(const t_usageName * pNames, byte nNames, unsigned int uxyy)
+{
+  byte nLow;
+  byte nHigh;
+  byte nMiddle;
+
+  nLow = 0;
+  nHigh = nNames;                     // Search pNames[nLow] to pNames[nHigh-1]
+  while (nLow < nHigh)
+  {
+    nMiddle = (nLow + nHigh) >> 1;
+    if (uxyy > pNames[nMiddle].uxyy)
+      nLow = nMiddle + 1;
+    else if (uxyy < pNames[nMiddle].uxyy)
+      nHigh = nMiddle;
+    else
+      return pNames[nMiddle].pName;
   }
+  return "";
 }
 
-const char * getDesc () // Note: Literals returned as const are in ROM
+const char * getDesc () // Note: Names returned as const are in ROM
 {
-  unsigned int nFunction;
+  byte nCode;
+  const char * pName;
 
-  nFunction = usbCommand.uxyy;  // ...compiles in less memory by doing this
+  nCode = usbCommand.s.yy;
   switch (usbCommand.s.ux.byte & 0xF0)
   {
     case USAGE_KEYBOARD:
-      pUnshiftedKey = getKeyWithNoShift();
-      if (usbCommand.s.ux.bits.LeftShift)
+      if (nCode >= KEYBOARD_NAMES)
+        return "";
+      if (usbCommand.s.ux.bits.LeftShift && nCode < SHIFTED_KEYBOARD_NAMES)
       {
-        pShiftedKey = getKeyWithShift();
-        if (*pShiftedKey)
-           return pShiftedKey;   // Name changes when SHIFT is pressed
-        else
-           return pUnshiftedKey; // Name does not change when SHIFT is pressed
+        pName = sShiftedKeyNames[nCode];
+        if (*pName)
+          return pName;             // Name changes when SHIFT is pressed
       }
-      else
-        return pUnshiftedKey;
+      return sKeyNames[nCode];      // Name does not change when SHIFT is pressed
     case USAGE_SYSTEM_CONTROL:
-      switch (nFunction)
-      {
-        case 0x1081: return "Power off";
-        case 0x1082: return "Sleep";
-        case 0x1083: return "Wake";
-        default: return "";
-      }
+      return findUsageName(systemControlNames, SYSTEM_CONTROL_NAMES, usbCommand.uxyy);
     case USAGE_CONSUMER_DEVICE:
-      switch (nFunction)
-      {
-        case 0x2040: return "Menu";           // Menu (on/off)
-        case 0x2041: return "Menu Pick";      // Menu Pick
-        case 0x2042: return "Menu \1";        // Menu Up
-        case 0x2043: return "Menu \2";        // Menu Down
-        case 0x2044: return "Menu \4";        // Menu Left
-        case 0x2045: return "Menu \3";        // Menu Right
-        case 0x2046: return "Menu Exit";      // Menu Escape
-        case 0x2047: return "Menu +";         // Menu Value Increase
-        case 0x2048: return "Menu -";         // Menu Value Decrease
-        case 0x209C: return "Ch+";            // Channel Up
-        case 0x209D: return "Ch-";            // Channel Down
-        case 0x20B0: return ">";              // Play
-        case 0x20B1: return "\6";             // Pause
-        case 0x20B2: return "Rec";            // Record
-        case 0x20B3: return ">>";             // Fast Forward
-        case 0x20B4: return "<<";             // Rewind
-        case 0x20B5: return ">>|";            // Next Track
-        case 0x20B6: return "|<<";            // Previous Track
-        case 0x20B7: return "Stop";           // Stop
-        case 0x20B8: return "Eject";          // Eject
-        case 0x20CD: return ">/\6";           // Play / Pause
-        case 0x20E2: return "Mute";           // Mute
-        case 0x20E9: return "Vol+";           // Volume Up
-        case 0x20EA: return "Vol-";           // Volume Down
-        case 0x2183: return "Media Player";   // Application: Consumer Control Configuration
-        case 0x2185: return "Text Editor";    // Application: Text Editor
-        case 0x218A: return "Email";          // Application: Email
-        case 0x2192: return "Calculator";     // Application: Calculator
-        case 0x2194: return "Computer";       // Application: Local Machine Browser
-        case 0x2196: return "Web Browser";    // Application: Web Browser
-        case 0x2221: return "Web Search";     // Browser: Search
-        case 0x2223: return "Web Home";       // Browser: Home
-        case 0x2224: return "Web Prev";       // Browser: Back
-        case 0x2225: return "Web Next";       // Browser: Next
-        case 0x2226: return "Web Stop";       // Browser: Stop
-        case 0x2227: return "Web Refresh";    // Browser: Reload
-        case 0x222A: return "Web Bookmarks";  // Browser: Bookmarks
-        default: return "";
-      }
+      return findUsageName(consumerDeviceNames, CONSUMER_DEVICE_NAMES, usbCommand.uxyy);
 //  case 0x30:     // Reserved
 //  case 0x40:     // Reserved
 //  case 0x50:     // Reserved
@@ -1050,30 +1655,68 @@ const char * getDesc () // Note: Literals returned as const are in ROM
 //  case 0xD0:     // Reserved
 //  case 0xE0:     // Reserved
     case USAGE_LOCAL_IRK_FUNCTION:     // IRK! local functions
-      switch (usbCommand.s.yy)
-      {
-        case CMD_SET_DEVICE_ADDRESS:  return "Set Address";
-        case CMD_PRESS_POWER_SWITCH:  return "Power Switch";
-        case CMD_PRESS_RESET_SWITCH:  return "Reset Switch";
-        case CMD_INIT_USB:            return "Init USB";
-        case CMD_SET_BACKLIGHT_OFF:   return "Light Off";   // Set delay = 0x00
-        case CMD_SET_BACKLIGHT_ON:    return "Light On";    // Set delay = 0xFF
-        case CMD_SET_BACKLIGHT_DELAY: return "Light Delay"; // Set delay = 0x01 to 0xFE (1 to 254 seconds)
-        case CMD_SET_DEBUG_OFF:       return "Debug Off";
-        case CMD_SET_DEBUG_ON:        return "Debug On";
-        case CMD_PRESS_AUX_SWITCH:    return "Aux Switch";
-        case CMD_POWER_SWITCH_ON:     return "Power Sw On";
-        case CMD_RESET_SWITCH_ON:     return "Reset Sw On";
-        case CMD_AUX_SWITCH_ON:       return "Aux Sw On";
-        case CMD_POWER_SWITCH_OFF:    return "Power Sw Off";
-        case CMD_RESET_SWITCH_OFF:    return "Reset Sw Off";
-        case CMD_AUX_SWITCH_OFF:      return "Aux Sw Off";
-        default: return "";
-      }
+      if (nCode >= LOCAL_FUNCTION_NAMES)
+        return "";
+      return sLocalFunctionNames[nCode];
     default: return "";
   }
 }
 
+// Which codes have a name, as one bit per code in groups of 16 codes (bit 0 is
+// the code ending in 0). This lets UP/DOWN find the next named code without
+// looking up the names of all the codes in between. It must be kept in step
+// with the name tables above. Each row covers the 256 codes (yy) of one x:
+#define NAMED_CODE_ROWS               6
+#define NO_NAMED_CODES                0xFF
+const unsigned int wNamedCodes[NAMED_CODE_ROWS][16] =
+{
+  { // 0: Keyboard (any modifiers)
+    0xFFF0, 0xFFFF, 0xFFFF, 0xFFFB, 0xFFFF, 0xFFFF, 0xFF8F, 0x000F,  // yy 00-7F
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000   // yy 80-FF
+  },
+  { // 1: System Control 0x1000-0x10FF
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,  // yy 00-7F
+    0x000E, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000   // yy 80-FF
+  },
+  { // 2: Consumer Device 0x2000-0x20FF
+    0x0000, 0x0000, 0x0000, 0x0000, 0x01FF, 0x0000, 0x0000, 0x0000,  // yy 00-7F
+    0x0000, 0x3000, 0x0000, 0x01FF, 0x2000, 0x0000, 0x0604, 0x0000   // yy 80-FF
+  },
+  { // 3: Consumer Device 0x2100-0x21FF
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,  // yy 00-7F
+    0x0428, 0x0054, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000   // yy 80-FF
+  },
+  { // 4: Consumer Device 0x2200-0x22FF
+    0x0000, 0x0000, 0x04FA, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,  // yy 00-7F
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000   // yy 80-FF
+  },
+  { // 5: IRK! local functions
+    0xFFFF, 0x0001, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,  // yy 00-7F
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000   // yy 80-FF
+  }
+};
+
+byte getNamedCodeRow()
+{
+  byte nX;
+
+  nX = usbCommand.s.ux.byte & 0x0F;
+  switch (usbCommand.s.ux.byte & 0xF0)
+  {
+    case USAGE_KEYBOARD:                    // x is the modifier keys
+      return 0;
+    case USAGE_SYSTEM_CONTROL:
+      if (nX == 0) return 1;
+      break;
+    case USAGE_CONSUMER_DEVICE:
+      if (nX <= 2) return 2 + nX;
+      break;
+    case USAGE_LOCAL_IRK_FUNCTION:          // x is ignored
+      return 5;
+  }
+  return NO_NAMED_CODES;
+}
+
 // Convert a byte (character) to printable hex (as in the Rexx Programming Language)
 void c2x (byte c, char * p)
 {
@@ -1084,20 +1727,118 @@ void c2x (byte c, char * p)
 
 void enableBacklight()
 {
+  if (bLowPowerMode) return;   // Backlight stays off while the host is suspended
   if (nConfigBacklightDelay == 0x00) return;
   if (nConfigBacklightDelay == 0xFF) return;
   LCD_BACKLIGHT = 0;           // Turn on backlight (0=On, 1=Off)
   nBacklightDelay = nConfigBacklightDelay;  // Keep backlight on for this many seconds
-  TMR0H = HiByte(ONE_SECOND);  // Set high-byte of 16-bit count
-  TMR0L = LoByte(ONE_SECOND);  // Set low-byte and write all 16 bits to Timer0
-  TMR0IF_bit = 0;              // Clear the Timer0 interrupt flag
-  TMR0IE_bit = 1;              // Enable Timer0 interrupts
-  TMR0ON_bit = 1;              // Turn on Timer0
+  startTimer(TIMER_BACKLIGHT, TICKS_PER_SECOND);
+}
+
+// The LCD is never cleared and redrawn. Instead, each line is compared with
+// what is already on the display and only the characters that differ are
+// written. A run of changed characters costs one cursor move plus one write
+// per character, so scrolling through codes typically rewrites just a few
+// characters instead of clearing (1.5 ms) and rewriting all 32.
+void startLCDQueue()
+{
+  T2CON |= LCD_TIMER2_POSTSCALE;      // PWM1_Start() may have reset the postscaler
+  TMR2ON_bit = 1;                     // Timer2 is only needed for PWM while transmitting
+  TMR2IE_bit = 1;                     // Timer2 interrupt stops itself when the queue is empty
+}
+
+void queueLCD(char c)
+{
+  byte nNext;
+  nNext = (nLCDQueueTail + 1) & (LCD_QUEUE_SIZE - 1);
+  while (nNext == nLCDQueueHead)      // If the queue is full
+    startLCDQueue();                  // ...wait for the interrupt to make room
+  cLCDQueue[nLCDQueueTail] = c;
+  nLCDQueueTail = nNext;
+  startLCDQueue();
+}
+
+void lcdCmd(char c)                   // Like Lcd_Cmd(c) but queued
+{
+  queueLCD(LCD_INSTRUCTION);
+  queueLCD(c);
+}
+
+void lcdChr(char c)                   // Like Lcd_Chr_CP(c) but queued
+{
+  if (c == LCD_INSTRUCTION) c = 0x08; // CGRAM character 0 is also at 0x08
+  queueLCD(c);
+}
+
+void clearLCD()
+{
+  byte i;
+  lcdCmd(_LCD_CLEAR);                 // Clear display
+  nLCDCursor = _LCD_FIRST_ROW;        // ...which also homes the cursor
+  for (i = 0; i < LCD_WIDTH; i++)
+  {
+    sLCDShadow[0][i] = ' ';
+    sLCDShadow[1][i] = ' ';
+  }
+}
+
+void lcdPut(byte nRow, byte nCol, char c) // Write c at nRow,nCol (from 1,0) if it is not already there
+{
+  byte nAddress;
+
+  if (sLCDShadow[nRow-1][nCol] == c) return;
+  nAddress = (nRow == 1 ? _LCD_FIRST_ROW : _LCD_SECOND_ROW) + nCol;
+  if (nAddress != nLCDCursor)         // LCD auto-increments the cursor, so only move it after a gap
+    lcdCmd(nAddress);
+  lcdChr(c);
+  sLCDShadow[nRow-1][nCol] = c;
+  nLCDCursor = nAddress + 1;
+}
+
+void lcdOut(byte nRow, char * s)      // Like Lcd_Out(nRow,1,s) but only writes changes
+{
+  byte nCol;
+  for (nCol = 0; nCol < LCD_WIDTH && *s; nCol++, s++)
+    lcdPut(nRow, nCol, *s);
+}
+
+void lcdOutText(byte nRow, const char * p) // Like lcdOut(nRow,s) but p is in ROM
+{
+  byte nCol;
+  for (nCol = 0; nCol < LCD_WIDTH && *p; nCol++, p++)
+    lcdPut(nRow, nCol, *p);
+}
+
+void padLCDLine(char * s)             // Blank the rest of the line
+{
+  byte i;
+  for (i = strlen(s); i < LCD_WIDTH; i++) s[i] = ' ';
+  s[LCD_WIDTH] = 0;
+}
+
+unsigned int getTicks()
+{
+  unsigned int w;
+  byte bLowEnabled;
+  bLowEnabled = PEIE_bit;   // The caller may already have interrupt_low() disabled
+  PEIE_bit = 0;             // Stop interrupt_low() updating wTicks while we read both bytes
+  w = wTicks;
+  PEIE_bit = bLowEnabled;
+  return w;
+}
+
+unsigned int getTimer3Count()         // Timer3 counts at 1.5 MHz (at 48 MHz)
+{
+  unsigned int w;
+  Lo(w) = TMR3L;                      // Reading TMR3L also latches TMR3H (RD16 = 1)
+  Hi(w) = TMR3H;
+  return w;
 }
 
 void showDebugInfo()
 {
   byte i;
+
   // Display debug information instead of the last key pressed
   // Debug Line 1:
   //        <---16 chars--->
@@ -1141,14 +1882,91 @@ void showDebugInfo()
      sLCDLine2[15] = DOWN_ARROW;
   sLCDLine2[16] = 0;
   nResetCount = 0;
-  Lcd_Cmd(_LCD_CLEAR);                // Clear display
-  Lcd_Out(1,1,&sLCDLine1);
-  Lcd_Out(2,1,&sLCDLine2);
+  bLCDUpdatePending = FALSE;          // This is now the latest state of the display
+  nFrameHistoryView = 0;              // UP/DOWN now scroll back from this frame
+  bShowingHistory = TRUE;
+  if (bLowPowerMode) return;          // Display is off while the host is suspended
+  lcdOut(1,&sLCDLine1);
+  lcdOut(2,&sLCDLine2);
+}
+
+const char * const sFrameOutcomes[] =
+{
+  "OK",                               // FRAME_OK
+  "Not for us",                       // FRAME_NOT_FOR_US
+  "Bad addr",                         // FRAME_BAD_ADDRESS
+  "Bad mods",                         // FRAME_BAD_MODIFIERS
+  "Bad cmd"                           // FRAME_BAD_COMMAND
+};
+
+void showFrameHistory()
+{
+  t_frameRecord * pFrame;
+  // Frame History Line 1:
+  //        <---16 chars--->
+  //       +0000000000111111
+  //       +0123456789012345
+  // Line1: h aa uxyy   tttt
+  //        h                  = History entry (0 = most recent frame)
+  //          aa               = Address byte received
+  //             uxyy          = Modifiers and command bytes received
+  //                    tttt   = wTicks when it was received (ms)
+  // Frame History Line 2:
+  // Line2: oooooooooo  nnnn
+  //        oooooooooo         = Outcome (OK, Not for us, Bad addr/mods/cmd)
+  //                    nnnn   = Number of resets before it was received
+  if (bLowPowerMode) return;          // Display is off while the host is suspended
+  if (nFrameHistoryCount == 0)
+  {
+    copyText(sLCDLine1, "No IR frames");
+    sLCDLine2[0] = 0;
+  }
+  else
+  {
+    pFrame = &frameHistory[(nFrameHistoryNext - 1 - nFrameHistoryView) & (FRAME_HISTORY_SIZE - 1)];
+    sLCDLine1[0] = '0' + nFrameHistoryView;
+    sLCDLine1[1] = ' ';
+    c2x(pFrame->nAddress, &sLCDLine1[2]);
+    sLCDLine1[4] = ' ';
+    c2x(Hi(pFrame->uxyy), &sLCDLine1[5]);
+    c2x(Lo(pFrame->uxyy), &sLCDLine1[7]);
+    sLCDLine1[9] = ' ';
+    sLCDLine1[10] = ' ';
+    sLCDLine1[11] = ' ';
+    c2x(Hi(pFrame->wReceivedTicks), &sLCDLine1[12]);
+    c2x(Lo(pFrame->wReceivedTicks), &sLCDLine1[14]);
+    sLCDLine1[16] = 0;
+    copyText(sLCDLine2, sFrameOutcomes[pFrame->nOutcome]);
+    padLCDLine(sLCDLine2);
+    c2x(Hi(pFrame->wResetCount), &sLCDLine2[12]);
+    c2x(Lo(pFrame->wResetCount), &sLCDLine2[14]);
+  }
+  padLCDLine(sLCDLine1);
+  padLCDLine(sLCDLine2);
+  lcdOut(1,sLCDLine1);
+  lcdOut(2,sLCDLine2);
+}
+
+void adjustHistoryView(signed short nDelta) // UP shows older frames, DOWN newer ones
+{
+  if (nDelta > 0)
+  {
+    if (nFrameHistoryView + 1 < nFrameHistoryCount) nFrameHistoryView++;
+  }
+  else
+  {
+    if (nFrameHistoryView > 0) nFrameHistoryView--;
+  }
 }
 
-void updateLCD()
+void refreshLCD()
 {
-  Lcd_Cmd(_LCD_CLEAR);                // Clear display
+  if (bShowingHistory)                // In debug mode, after an IR frame has been shown
+  {
+    showFrameHistory();
+    return;
+  }
+  if (bLowPowerMode) return;          // Display is off while the host is suspended
   c2x(usbCommand.s.ux.byte, sLCDLine1);
   sLCDLine1[2] = ' ';
   sLCDLine1[3] = 0;
@@ -1157,7 +1975,7 @@ void updateLCD()
     case USAGE_KEYBOARD:
       if (bSettingUsage)
       {
-         strcat(sLCDLine1,_TEXT("Keyboard"));
+         appendText(sLCDLine1,"Keyboard");
       }
       else
       {
@@ -1165,59 +1983,59 @@ void updateLCD()
         switch (usbCommand.s.ux.byte & 0x0F)
         {
         case 0x00:  // if no modifier keys pressed
-          strcat(sLCDLine1,_TEXT("Keyboard"));
+          appendText(sLCDLine1,"Keyboard");
           break;
         case 0x0F:  // if all modifier keys pressed
-          strcat(sLCDLine1,_TEXT("GUI + ALL")); // text won't fit otherwise
+          appendText(sLCDLine1,"GUI + ALL"); // text won't fit otherwise
           break;
         default:
-          if (usbCommand.s.ux.bits.LeftGUI)     strcat(sLCDLine1,_TEXT("GUI "));
-          if (usbCommand.s.ux.bits.LeftControl) strcat(sLCDLine1,_TEXT("CTL "));
-          if (usbCommand.s.ux.bits.LeftAlt)     strcat(sLCDLine1,_TEXT("ALT "));
-          if (usbCommand.s.ux.bits.LeftShift)   strcat(sLCDLine1,_TEXT("SHIFT"));
+          if (usbCommand.s.ux.bits.LeftGUI)     appendText(sLCDLine1,"GUI ");
+          if (usbCommand.s.ux.bits.LeftControl) appendText(sLCDLine1,"CTL ");
+          if (usbCommand.s.ux.bits.LeftAlt)     appendText(sLCDLine1,"ALT ");
+          if (usbCommand.s.ux.bits.LeftShift)   appendText(sLCDLine1,"SHFT");
         }
       }
       break;
     case USAGE_SYSTEM_CONTROL:
-      strcat(sLCDLine1,_TEXT("System"));
+      appendText(sLCDLine1,"System");
       break;
     case USAGE_CONSUMER_DEVICE:
-      strcat(sLCDLine1,_TEXT("Consumer Dev"));
+      appendText(sLCDLine1,"Consumer Dev");
       break;
     case USAGE_LOCAL_IRK_FUNCTION:
-      strcat(sLCDLine1,_TEXT("IRK! Function"));
+      appendText(sLCDLine1,"IRK! Local");
     default:
       break;
   }
 
   if (bSettingUsage)
   {
-    strcpy(sLCDLine2,_TEXT("\1\1 Select Usage"));  // ^^ Select Usage
+    copyText(sLCDLine2,"\1\1 Select Usage");  // ^^ Select Usage
   }
   else if (bSettingDeviceAddress)
   {
     c2x(nConfigDeviceAddress, sLCDLine2);
     sLCDLine2[2] = ' ';
     sLCDLine2[3] = 0;
-    strcat(sLCDLine2,_TEXT("\4 Address"));  // <- Address
+    appendText(sLCDLine2,"\4 Address");  // <- Address
   }
   else if (bSettingBacklightDelay)
   {
     c2x(nNewBacklightDelay, sLCDLine2);
     sLCDLine2[2] = ' ';
     sLCDLine2[3] = 0;
-    strcat(sLCDLine2,_TEXT("\4 "));         // <-
+    appendText(sLCDLine2,"\4 ");         // <-
     switch (nNewBacklightDelay)
     {
       case 0x00:
-        strcat(sLCDLine2,_TEXT("Off"));
+        appendText(sLCDLine2,"Off");
         break;
       case 0xFF:
-        strcat(sLCDLine2,_TEXT("On"));
+        appendText(sLCDLine2,"On");
         break;
       default:
         ByteToStr(nNewBacklightDelay, sLCDLine2+5);
-        strcat(sLCDLine2,_TEXT(" secs"));
+        appendText(sLCDLine2," secs");
     }
   }
   else
@@ -1226,195 +2044,722 @@ void updateLCD()
     c2x(usbCommand.s.yy, sLCDLine2);
     sLCDLine2[2] = ' ';
     sLCDLine2[3] = 0;
-    strncat(sLCDLine2, _TEXT(getDesc()), 13);
+    appendText(sLCDLine2, getDesc());
   }
-  Lcd_Out(1,1,sLCDLine1);
-  Lcd_Out(2,1,sLCDLine2);
+  padLCDLine(sLCDLine1);
+  padLCDLine(sLCDLine2);
+  sLCDLine1[LCD_WIDTH-1] = STATUS_GLYPH; // Text above is at most 15 characters
+  lcdOut(1,sLCDLine1);
+  lcdOut(2,sLCDLine2);
 }
 
-void enableUSB()
+void updateLCD()                      // Redraw the display soon (see serviceLCD)
 {
-  byte i;
+  bLCDUpdatePending = TRUE;
+}
 
-  enableBacklight();                       // Conditionally turn on LCD backlight
-  Lcd_Out(2,1,_TEXT("Enabling USB    "));
+void serviceLCD()
+{
+  unsigned int wNow;
+
+  if (!bLCDUpdatePending) return;
+  wNow = getTicks();
+  if (wNow - wLCDRefreshTicks < LCD_REFRESH_TICKS) return; // Redrawn too recently
+  wLCDRefreshTicks = wNow;
+  bLCDUpdatePending = FALSE;
+  refreshLCD();
+}
+
+// The last cell of the first line of the normal display is a status glyph that
+// is redrawn in CGRAM (so the display text itself is not rewritten) whenever
+// the state it shows changes:
+//
+//        Rows  Shows
+//        ----  -------------------------------------------------------------
+//        0-1   USB: solid = ready, outline = suspended, dots = enumerating,
+//                   blank = no USB power
+//        3-4   IR:  a bar that gets shorter the more the decoder was reset
+//                   (by noise or corrupted frames) before the last frame;
+//                   full = no resets, blank = no frames received yet
+//        6-7   USB queue: one pixel per report waiting to be sent (up to 5)
+//
+const byte usbStatusRows[4][2] =
+{
+  {0b00000, 0b00000},                 // No USB power
+  {0b10101, 0b00000},                 // Enumerating
+  {0b11111, 0b10001},                 // Suspended
+  {0b11111, 0b11111}                  // Ready
+};
+const byte statusBarRows[6] = {0b00000, 0b10000, 0b11000, 0b11100, 0b11110, 0b11111};
+#define LCD_SET_CGRAM_ADDRESS         0x40
+byte nStatusGlyph;                    // What the status glyph is showing (uu iii qqq)
+
+void updateStatusGlyph()
+{
+  byte nUSB;
+  byte nIR;
+  byte nQueue;
+  byte nResets;
+  byte nNewGlyph;
+
+  if (bLowPowerMode) return;          // Display is off while the host is suspended
+  if (bUSBSuspended)
+    nUSB = 2;
+  else if (nUSBState == USB_STATE_READY)
+    nUSB = 3;
+  else if (nUSBState == USB_STATE_DETACHED)
+    nUSB = 0;
+  else
+    nUSB = 1;
+  nIR = 0;
+  if (nFrameHistoryCount)
+  {
+    nIR = 5;
+    for (nResets = nResetsBeforeFrame; nResets && nIR > 1; nResets >>= 1)
+      nIR--;                          // 0 resets = 5, 1 = 4, 2-3 = 3, 4-7 = 2, 8+ = 1
+  }
+  nQueue = USB_QUEUE_DEPTH;
+  if (nQueue > 5) nQueue = 5;
+  nNewGlyph = nUSB << 6 | nIR << 3 | nQueue;
+  if (nNewGlyph == nStatusGlyph) return;  // Nothing has changed
+  nStatusGlyph = nNewGlyph;
+  lcdCmd(LCD_SET_CGRAM_ADDRESS);      // Symbol #0 is at CGRAM address 0
+  // CGRAM only uses the low 5 bits of each row, so the top bits are set to
+  // avoid queueing a 0 (which the LCD queue treats as LCD_INSTRUCTION)
+  queueLCD(0b11100000 | usbStatusRows[nUSB][0]);
+  queueLCD(0b11100000 | usbStatusRows[nUSB][1]);
+  queueLCD(0b11100000);
+  queueLCD(0b11100000 | statusBarRows[nIR]);
+  queueLCD(0b11100000 | statusBarRows[nIR]);
+  queueLCD(0b11100000);
+  queueLCD(0b11100000 | statusBarRows[nQueue]);
+  queueLCD(0b11100000 | statusBarRows[nQueue]);
+  nLCDCursor = 0xFF;                  // The next character needs a DDRAM address
+}
+
+void setUSBState(byte nNewState)
+{
+  nUSBState = nNewState;
+  wUSBStateTicks = getTicks();
+  wUSBPollTicks = wUSBStateTicks;
+}
 
+void attachUSB()                           // Also called by Prolog() before the LCD is ready
+{
   sUSBCommand[0] = REPORT_ID_KEYBOARD;     // Report Id = Keyboard
   sUSBCommand[1] = 0;                      // No modifiers
   sUSBCommand[2] = 0;                      // Reserved for OEM
   sUSBCommand[3] = 0;                      // No key pressed
   bUSBReady = FALSE;
-  while (!bUSBReady)
-  {
-    HID_Enable(&sUSBResponse, &sUSBCommand);
-    for (i=0; !bUSBReady && i < 50; i++)
-    {
-      ACTIVITY_LED = ON;    // Flash activity to indicate init in progress
-      Delay_ms(50);
-      ACTIVITY_LED = OFF;
-      Delay_ms(50);
-      bUSBReady = HID_Write(&sUSBCommand, 4) != 0; // Copy to USB buffer and try to send
-    }
-    if (!bUSBReady)
-    {
-      enableBacklight();      // Keep LCD backlight on while retrying USB init
-      HID_Disable();
-      Delay_ms(5000);
-    }
-  }
-  Lcd_Out(2,1,_TEXT("USB Ready   "));
+  HID_Enable(&sUSBResponse, &sUSBCommand);
+  setUSBState(USB_STATE_ENABLING);         // serviceUSB() takes it from here
 }
 
-void disableUSB()
+void enableUSB()
 {
-  HID_Disable();
-  Lcd_Out(2,1,_TEXT("USB Disabled"));
-  bUSBReady = FALSE;
+  enableBacklight();                       // Conditionally turn on LCD backlight
+  lcdOutText(2,"Enabling USB    ");
+  attachUSB();
 }
 
-void sendUSBKeystroke()
+void showBootTimes()
 {
-  if (bUSBReady)
+  byte i;
+  // Boot Line 1 (replaces debug line 1 until the next IR frame):
+  //        <---16 chars--->
+  //       +0000000000111111
+  //       +0123456789012345
+  // Line1: B uuuu llll rrrr
+  //          uuuu             = ms until IR capture was on and USB attached
+  //               llll        = ms until the LCD was initialised
+  //                    rrrr   = ms until USB was enumerated (first keystroke)
+  sLCDLine1[0] = 'B';
+  for (i = 0; i < BOOT_PHASES; i++)
   {
-    sUSBCommand[0] = REPORT_ID_KEYBOARD;      // Report Id = Keyboard
-    sUSBCommand[1] = usbCommand.s.ux.byte;    // Ctrl/Alt/Shift modifiers
-    sUSBCommand[2] = 0;                       // Reserved for OEM
-    sUSBCommand[3] = usbCommand.s.yy;         // Key pressed
-    while(!HID_Write(&sUSBCommand, 4));       // Copy to USB buffer and try to send
-    sUSBCommand[1] = 0;                       // No modifiers now
-    sUSBCommand[3] = 0;                       // No key pressed now
-    while(!HID_Write(&sUSBCommand, 4));       // Copy to USB buffer and try to send
+    sLCDLine1[1+i*5] = ' ';
+    c2x(Hi(wBootTicks[i]), &sLCDLine1[2+i*5]);
+    c2x(Lo(wBootTicks[i]), &sLCDLine1[4+i*5]);
   }
+  sLCDLine1[16] = 0;
+  lcdOut(1,&sLCDLine1);
 }
 
-void sendUSBSystemControlCommand()
+void usbReady()
 {
-  if (bUSBReady)
+  ACTIVITY_LED = OFF;
+  bUSBReady = TRUE;
+  nUSBQueueHead = 0;                       // Discard any stale reports
+  nUSBQueueTail = 0;
+  bUSBSuspended = FALSE;
+  IDLEIE_bit = 1;                          // Interrupt when the host suspends the bus
+  setUSBState(USB_STATE_READY);
+  lcdOutText(2,"USB Ready   ");
+  if (wBootTicks[BOOT_PHASE_READY] == 0)   // If this is the first time since power up
   {
-    sUSBCommand[0] = REPORT_ID_SYSTEM_CONTROL;// Report Id = System Control (power)
-    sUSBCommand[1] = usbCommand.s.yy;         // Power function requested
-    while(!HID_Write(&sUSBCommand, 2));       // Copy to USB buffer and try to send
-    sUSBCommand[1] = 0;                       // No power function requested anymore
-    while(!HID_Write(&sUSBCommand, 2));       // Copy to USB buffer and try to send
+    wBootTicks[BOOT_PHASE_READY] = getTicks();
+    if (bDebugMode) showBootTimes();
   }
 }
 
-void sendUSBConsumerDeviceCommand()
+void disableUSB()
 {
-  if (bUSBReady)
-  {
-    sUSBCommand[0] = REPORT_ID_CONSUMER_DEVICE; // Report Id = Consumer Device
-    sUSBCommand[1] = usbCommand.s.yy;         // Function requested (low byte)
-    sUSBCommand[2] = usbCommand.s.ux.byte & 0x0F;    // Function requested (high byte)
-    while(!HID_Write(&sUSBCommand, 3));       // Copy to USB buffer and try to send
-    sUSBCommand[1] = 0;                      // Function requested low byte
-    sUSBCommand[2] = 0;                      // Function requested high byte
-    while(!HID_Write(&sUSBCommand, 3));      // Copy to USB buffer and try to send
-  }
+  IDLEIE_bit = 0;                          // Stop tracking USB suspend/resume
+  ACTVIE_bit = 0;
+  SUSPND_bit = 0;
+  HID_Disable();
+  lcdOutText(2,"USB Disabled");
+  bUSBReady = FALSE;
+  bUSBSuspended = FALSE;
+  nUSBQueueHead = 0;                       // Discard any unsent reports
+  nUSBQueueTail = 0;
+  bConfigReplyPending = FALSE;
+  bRemoteWakeupEnabled = FALSE;            // The host enables it again after it enumerates
+  setUSBState(USB_STATE_DETACHED);
 }
 
-void performLocalIRKFunction()
+void serviceUSB()
 {
-  switch (usbCommand.s.yy)
+  unsigned int wNow;
+
+  wNow = getTicks();
+  switch (nUSBState)
   {
-    case CMD_PRESS_POWER_SWITCH:
-      POWER_SWITCH = ON;
-      Delay_ms(250);
-    case CMD_POWER_SWITCH_OFF:
-      POWER_SWITCH = OFF;
-      break;
-    case CMD_PRESS_RESET_SWITCH:
-      RESET_SWITCH = ON;
-      Delay_ms(250);
-    case CMD_RESET_SWITCH_OFF:
-      RESET_SWITCH = OFF;
-      break;
-    case CMD_PRESS_AUX_SWITCH:
-      AUX_SWITCH = ON;
-      Delay_ms(250);
-    case CMD_AUX_SWITCH_OFF:
-      AUX_SWITCH = OFF;
-      break;
-    case CMD_POWER_SWITCH_ON:
-      POWER_SWITCH = ON;
-      break;
-    case CMD_RESET_SWITCH_ON:
-      RESET_SWITCH = ON;
-      break;
-    case CMD_AUX_SWITCH_ON:
-      AUX_SWITCH = ON;
-      break;
-    case CMD_INIT_USB:
-      disableUSB();
-      enableUSB();
-      break;
-    case CMD_SET_BACKLIGHT_OFF:   // User wants backlight temporarily OFF
-      nConfigBacklightDelay = 0x00;
-      actionBacklightDelay();
+    case USB_STATE_DETACHED:
+      if (USB_POWER_GOOD)                  // If USB is now powered
+        enableUSB();                       // Then enable USB interface
       break;
-    case CMD_SET_BACKLIGHT_ON:    // User wants backlight temporarily ON
-      nConfigBacklightDelay = 0xFF;
-      actionBacklightDelay();
+    case USB_STATE_ENABLING:
+      if (!USB_POWER_GOOD)                 // If USB is now unpowered
+      {
+        disableUSB();                      // So disable USB interface
+      }
+      else if (wNow - wUSBPollTicks >= USB_POLL_TICKS)
+      {
+        wUSBPollTicks = wNow;
+        ACTIVITY_LED ^= 1;                 // Flash activity to indicate init in progress
+        if (HID_Write(&sUSBCommand, 4))    // Copy to USB buffer and try to send
+        {
+          usbReady();
+        }
+        else if (wNow - wUSBStateTicks >= USB_ENABLE_TIMEOUT_TICKS)
+        {
+          ACTIVITY_LED = OFF;
+          HID_Disable();                   // Give up for now...
+          setUSBState(USB_STATE_RETRY_WAIT);
+        }
+      }
       break;
-    case CMD_SET_DEBUG_OFF:
-      bDebugMode = OFF;
-      updateLCD();
+    case USB_STATE_RETRY_WAIT:
+      if (!USB_POWER_GOOD)
+      {
+        setUSBState(USB_STATE_DETACHED);
+      }
+      else if (wNow - wUSBStateTicks >= USB_RETRY_DELAY_TICKS)
+      {
+        enableUSB();                       // ...and try again later
+      }
       break;
-    case CMD_SET_DEBUG_ON:
-      bDebugMode = ON;
+    case USB_STATE_READY:
+      if (!USB_POWER_GOOD)
+        disableUSB();
       break;
-    case CMD_SET_DEVICE_ADDRESS:
-      break;    // Do nothing, user is setting the IRK! device address
     default:
       break;
   }
 }
 
-void executeCommand()
+void queueUSBReport(byte nReportId, byte b1, byte b2, byte b3, byte nLength)
 {
-  nActivityLEDDelay = 10000;  // Number of main loop iterations to keep the activity LED glowing
-  ACTIVITY_LED = ON;
-  switch (usbCommand.s.ux.byte & 0xF0)   // 0xUM (Usage 4 bits, Modifiers 4 bits)
+  usbQueue[nUSBQueueTail][0] = nReportId;
+  usbQueue[nUSBQueueTail][1] = b1;
+  usbQueue[nUSBQueueTail][2] = b2;
+  usbQueue[nUSBQueueTail][3] = b3;
+  usbQueueLength[nUSBQueueTail] = nLength;
+  nUSBQueueTail = (nUSBQueueTail + 1) & (USB_QUEUE_SIZE - 1);
+}
+
+void serviceUSBQueue()
+{
+  if (nUSBQueueHead == nUSBQueueTail) return;   // Nothing to send
+  if (!bUSBReady || bUSBSuspended) return;      // Hold reports until the host can take them
+  if (HID_Write(&usbQueue[nUSBQueueHead], usbQueueLength[nUSBQueueHead])) // Copy to USB buffer and try to send
   {
-    case USAGE_KEYBOARD:
-      sendUSBKeystroke();
-      break;
-    case USAGE_SYSTEM_CONTROL:
-      sendUSBSystemControlCommand();
-      break;
-    case USAGE_CONSUMER_DEVICE:
-      sendUSBConsumerDeviceCommand();
-      break;
-    case USAGE_LOCAL_IRK_FUNCTION:
-      performLocalIRKFunction();
-      break;
-    default:
-      break;
+    nUSBQueueHead = (nUSBQueueHead + 1) & (USB_QUEUE_SIZE - 1);
+  }
+  else if (bTelemetryOn)
+  {
+    wUSBBusyCount++;        // Host has not polled for the previous report yet
   }
 }
 
-void gotoResetState()
+void serviceConfigReply()   // Like serviceUSBQueue() but for the 8-byte configuration reply
 {
-  nState = STATE_IR_RESET;
-  nByte = 0;
-  nBit = 0;
-  nResetCount++;
+  if (!bConfigReplyPending) return;
+  if (!bUSBReady || bUSBSuspended) return;      // Hold the reply until the host can take it
+  if (HID_Write(&sConfigReport, 8))             // Copy to USB buffer and try to send
+    bConfigReplyPending = FALSE;
 }
 
-void disableInfraredCapture()
+void resetInterruptStatistics()
 {
-  CCP2IE_bit = 0;           // Disable CCP2 interrupts
+  GIE_bit = 0;                                  // interrupt_low() updates them
+  wISRLongestRun = 0;
+  ulISRTotalRun = 0;
+  wISRCount = 0;
+  wLongestCaptureDelay = 0;
+  GIE_bit = 1;
+}
+void startTelemetry(byte nSeconds)
+{
+  byte i;
+  bTelemetryOn = FALSE;
+  if (nSeconds == 0) return;                    // Host reader has gone away
+  for (i = 0; i < RESET_REASONS; i++) nResetReasonCount[i] = 0;
+  wUSBBusyCount = 0;
+  wUSBDroppedCount = 0;
+  for (i = 0; i < TASKS; i++) wTaskLongestRun[i] = 0;
+  resetInterruptStatistics();
+  ulIdleTotal = 0;
+  wIdleCount = 0;
+  wIdleSinceTicks = getTicks();
+  nTelemetryPending = 0;
+  nTelemetryLeaseSeconds = nSeconds;
+  wTelemetrySentTicks = getTicks();
+  wTelemetryStatsTicks = wTelemetrySentTicks;
+  bTelemetryOn = TRUE;
 }
 
-void enableInfraredCapture()
+void buildTelemetryReport()
 {
-  CCP2IE_bit = 0;           // Disable CCP2 interrupts while resetting capture mode
-  CCP2IF_bit = 0;           // Reset CCP2 interrupt flag
+  byte i;
+  unsigned int wAverage;
+  unsigned int wCount;
+  unsigned long ulTotal;
+  sTelemetryReport[0] = REPORT_ID_TELEMETRY;
+  if (nTelemetryPending & TELEMETRY_FRAME)
+  {
+    sTelemetryReport[1] = 'F';                  // Frame: aa aa' ux ux' yy yy'
+    for (i = 0; i < 6; i++) sTelemetryReport[2+i] = sTelemetryFrame[i];
+  }
+  else if (nTelemetryPending & TELEMETRY_RESULT)
+  {
+    sTelemetryReport[1] = 'R';                  // Result: oo rrrr wwww ss
+    sTelemetryReport[2] = nTelemetryOutcome;
+    sTelemetryReport[3] = Hi(wTelemetryResetCount);
+    sTelemetryReport[4] = Lo(wTelemetryResetCount);
+    sTelemetryReport[5] = Hi(wTelemetryPulseWidth);
+    sTelemetryReport[6] = Lo(wTelemetryPulseWidth);
+    sTelemetryReport[7] = nState;
+  }
+  else if (nTelemetryPending & TELEMETRY_RESETS)
+  {
+    sTelemetryReport[1] = 'X';                  // Resets: one count per RESET_xxx reason
+    for (i = 0; i < RESET_REASONS; i++) sTelemetryReport[2+i] = nResetReasonCount[i];
+  }
+  else if (nTelemetryPending & TELEMETRY_TASKS)
+  {
+    sTelemetryReport[1] = 'S';                  // Scheduler: iiii uuuu llll
+    for (i = 0; i < TASKS; i++)
+    {
+      sTelemetryReport[2+i+i] = Hi(wTaskLongestRun[i]);
+      sTelemetryReport[3+i+i] = Lo(wTaskLongestRun[i]);
+    }
+  }
+  else if (nTelemetryPending & TELEMETRY_INTERRUPTS)
+  {
+    sTelemetryReport[1] = 'I';                  // Interrupts: mmmm aaaa dddd
+    GIE_bit = 0;                                // Take a consistent snapshot
+    sTelemetryReport[2] = Hi(wISRLongestRun);
+    sTelemetryReport[3] = Lo(wISRLongestRun);
+    sTelemetryReport[6] = Hi(wLongestCaptureDelay);
+    sTelemetryReport[7] = Lo(wLongestCaptureDelay);
+    ulTotal = ulISRTotalRun;
+    wCount = wISRCount;
+    GIE_bit = 1;
+    wAverage = 0;
+    if (wCount)
+      wAverage = ulTotal / wCount;
+    sTelemetryReport[4] = Hi(wAverage);
+    sTelemetryReport[5] = Lo(wAverage);
+  }
+  else if (nTelemetryPending & TELEMETRY_IDLE)
+  {
+    sTelemetryReport[1] = 'W';                  // Wait (idle): pp nnnn
+    wCount = getTicks() - wIdleSinceTicks;      // ms since the counts were reset
+    sTelemetryReport[2] = 0;
+    if (wCount)
+      sTelemetryReport[2] = ulIdleTotal / ((unsigned long)wCount * (TIMER3_RATE / TICKS_PER_SECOND / 100));
+    sTelemetryReport[3] = Hi(wIdleCount);
+    sTelemetryReport[4] = Lo(wIdleCount);
+    sTelemetryReport[5] = 0;
+    sTelemetryReport[6] = 0;
+    sTelemetryReport[7] = 0;
+  }
+  else
+  {
+    sTelemetryReport[1] = 'U';                  // USB: qq bbbb dddd ss
+    sTelemetryReport[2] = USB_QUEUE_DEPTH;
+    sTelemetryReport[3] = Hi(wUSBBusyCount);
+    sTelemetryReport[4] = Lo(wUSBBusyCount);
+    sTelemetryReport[5] = Hi(wUSBDroppedCount);
+    sTelemetryReport[6] = Lo(wUSBDroppedCount);
+    sTelemetryReport[7] = nUSBState;
+  }
+}
+
+void serviceTelemetry()
+{
+  byte i;
+  unsigned int wNow;
+
+  if (!bTelemetryOn) return;                    // Nobody is listening
+  wNow = getTicks();
+  if (wNow - wTelemetryStatsTicks >= TELEMETRY_STATS_TICKS)
+  {
+    if (--nTelemetryLeaseSeconds == 0)
+    {
+      bTelemetryOn = FALSE;                     // Host has stopped renewing its request
+      return;
+    }
+    wTelemetryStatsTicks = wNow;
+    nTelemetryPending |= TELEMETRY_RESETS | TELEMETRY_USB | TELEMETRY_TASKS | TELEMETRY_INTERRUPTS | TELEMETRY_IDLE;
+  }
+  if (nTelemetryPending == 0) return;
+  if (wNow - wTelemetrySentTicks < TELEMETRY_INTERVAL_TICKS) return;
+  if (!bUSBReady || bUSBSuspended) return;
+  if (nUSBQueueHead != nUSBQueueTail) return;   // Commands for the host go first
+  if (bConfigReplyPending) return;              // ...and so do configuration replies
+  buildTelemetryReport();
+  if (HID_Write(&sTelemetryReport, 8))          // Copy to USB buffer and try to send
+  {
+    wTelemetrySentTicks = wNow;
+    switch (sTelemetryReport[1])                // Mark the record as sent
+    {
+      case 'F': nTelemetryPending &= ~TELEMETRY_FRAME;  break;
+      case 'R': nTelemetryPending &= ~TELEMETRY_RESULT; break;
+      case 'X':
+        nTelemetryPending &= ~TELEMETRY_RESETS;
+        for (i = 0; i < RESET_REASONS; i++) nResetReasonCount[i] = 0;
+        break;
+      case 'S':
+        nTelemetryPending &= ~TELEMETRY_TASKS;
+        for (i = 0; i < TASKS; i++) wTaskLongestRun[i] = 0;
+        break;
+      case 'I':
+        nTelemetryPending &= ~TELEMETRY_INTERRUPTS;
+        resetInterruptStatistics();
+        break;
+      case 'W':
+        nTelemetryPending &= ~TELEMETRY_IDLE;
+        ulIdleTotal = 0;
+        wIdleCount = 0;
+        wIdleSinceTicks = wNow;
+        break;
+      default:  nTelemetryPending &= ~TELEMETRY_USB;    break;
+    }
+  }
+}
+
+void recordFrameHistory(byte nOutcome)  // Overwrites the oldest entry when full
+{
+  t_frameRecord * pFrame;
+  pFrame = &frameHistory[nFrameHistoryNext];
+  pFrame->wReceivedTicks = getTicks();
+  pFrame->uxyy = irCommand.s.nModifiers << 8 | irCommand.s.nCommand;
+  pFrame->wResetCount = nResetCount;
+  pFrame->nAddress = irCommand.s.nAddress;
+  pFrame->nOutcome = nOutcome;
+  nFrameHistoryNext = (nFrameHistoryNext + 1) & (FRAME_HISTORY_SIZE - 1);
+  if (nFrameHistoryCount < FRAME_HISTORY_SIZE) nFrameHistoryCount++;
+  nResetsBeforeFrame = nResetsSinceFrame;
+  nResetsSinceFrame = 0;
+}
+
+void recordTelemetryFrame(byte nOutcome)
+{
+  byte i;
+  for (i = 0; i < 6; i++) sTelemetryFrame[i] = irCommand.b[i];
+  nTelemetryOutcome = nOutcome;
+  wTelemetryResetCount = nResetCount;
+  wTelemetryPulseWidth = nPulseWidth;
+  nTelemetryPending |= TELEMETRY_FRAME | TELEMETRY_RESULT;  // Latest frame wins
+}
+
+void signalRemoteWakeup()
+{
+  unsigned int wIdleTicks;
+  PEIE_bit = 0;             // wTicks and wSuspendTicks are written by interrupt_low()
+  wIdleTicks = wTicks - wSuspendTicks;
+  PEIE_bit = 1;
+  if (wIdleTicks < USB_RESUME_IDLE_TICKS) // The tick may have stopped while suspended,
+    Delay_ms(USB_RESUME_IDLE_TICKS);      // so wait rather than poll it
+  SUSPND_bit = 0;           // Bring the USB module out of its low power state
+  RESUME_bit = 1;           // Drive resume signalling onto the bus...
+  Delay_ms(10);             // ...for between 1 and 15 ms (USB 2.0 section 7.1.7.7)
+  RESUME_bit = 0;           // The host then resumes the bus and sends SOFs again
+}
+
+byte isRemoteWakeupCommand()
+{
+  if (usbCommand.uxyy == SYSTEM_CONTROL_WAKE) return TRUE;
+  return (nConfigOptions & OPTION_WAKE_ON_ANY_KEY) != 0;
+}
+
+byte canSendUSBReports(byte nReports)
+{
+  if (!bUSBReady) return FALSE;
+  if (USB_QUEUE_FREE < nReports ||              // Drop the command rather than wait
+      (bUSBSuspended &&                         // If the host is asleep then only wake-class
+       (!bRemoteWakeupEnabled || !isRemoteWakeupCommand()))) // commands are kept (if the host
+  {                                             // allows it to be woken), and are sent once
+    if (bTelemetryOn) wUSBDroppedCount++;       // the host has resumed
+    return FALSE;
+  }
+  if (bUSBSuspended) signalRemoteWakeup();
+  return TRUE;
+}
+
+void sendUSBKeystroke()
+{
+  if (canSendUSBReports(2))
+  {
+    queueUSBReport(REPORT_ID_KEYBOARD,        // Report Id = Keyboard
+                   usbCommand.s.ux.byte,      // Ctrl/Alt/Shift modifiers
+                   0,                         // Reserved for OEM
+                   usbCommand.s.yy,           // Key pressed
+                   4);
+    queueUSBReport(REPORT_ID_KEYBOARD, 0, 0, 0, 4); // No modifiers and no key pressed now
+  }
+}
+
+void sendUSBSystemControlCommand()
+{
+  if (canSendUSBReports(2))
+  {
+    queueUSBReport(REPORT_ID_SYSTEM_CONTROL,  // Report Id = System Control (power)
+                   usbCommand.s.yy,           // Power function requested
+                   0, 0, 2);
+    queueUSBReport(REPORT_ID_SYSTEM_CONTROL, 0, 0, 0, 2); // No power function requested anymore
+  }
+}
+
+void sendUSBConsumerDeviceCommand()
+{
+  if (canSendUSBReports(2))
+  {
+    queueUSBReport(REPORT_ID_CONSUMER_DEVICE, // Report Id = Consumer Device
+                   usbCommand.s.yy,           // Function requested (low byte)
+                   usbCommand.s.ux.byte & 0x0F, // Function requested (high byte)
+                   0, 3);
+    queueUSBReport(REPORT_ID_CONSUMER_DEVICE, 0, 0, 0, 3); // No function requested anymore
+  }
+}
+
+void processConfigRequest()
+{
+  byte i;
+  byte nLength;
+  unsigned int wAddress;
+
+  wAddress = sUSBResponse[2];
+  nLength  = sUSBResponse[3];
+  if (nLength > CONFIG_MAX_DATA)            // Clamp the request to one report's worth
+    nLength = CONFIG_MAX_DATA;
+  if (wAddress + nLength > EEPROM_SIZE)     // ...and to the end of the EEPROM
+    nLength = EEPROM_SIZE - wAddress;
+  switch (sUSBResponse[1])
+  {
+    case CONFIG_OP_INFO:
+      nLength = 0;
+      sConfigReport[4] = CONFIG_IMAGE_SIZE;   // Number of EEPROM bytes used by IRK!
+      sConfigReport[5] = CONFIG_MAX_DATA;     // Maximum data bytes per report
+      sConfigReport[6] = 0;
+      sConfigReport[7] = 0;
+      break;
+    case CONFIG_OP_WRITE:
+      for (i = 0; i < nLength; i++)
+      {
+        if (EEPROM_Read(wAddress + i) != sUSBResponse[4+i]) // Only write bytes that have changed
+          EEPROM_Write(wAddress + i, sUSBResponse[4+i]);    // ...to save EEPROM wear
+      }
+      reloadConfig(wAddress, nLength);      // Act on the new configuration now
+      if (!bDebugMode) updateLCD();         // ...and show any new address etc
+      // Fall through to return what is now in EEPROM
+    case CONFIG_OP_READ:
+      for (i = 0; i < CONFIG_MAX_DATA; i++)
+      {
+        if (i < nLength)
+          sConfigReport[4+i] = EEPROM_Read(wAddress + i);
+        else
+          sConfigReport[4+i] = 0;
+      }
+      break;
+    case CONFIG_OP_TELEMETRY:               // Host wants telemetry for the next dd seconds
+      startTelemetry(sUSBResponse[4]);      // (dd = 00 stops it)
+      nLength = 0;
+      sConfigReport[4] = sUSBResponse[4];
+      for (i = 1; i < CONFIG_MAX_DATA; i++) sConfigReport[4+i] = 0;
+      break;
+    default:                                // Unknown operation
+      nLength = 0;
+      for (i = 0; i < CONFIG_MAX_DATA; i++) sConfigReport[4+i] = 0;
+      break;
+  }
+  sConfigReport[0] = REPORT_ID_CONFIG;      // Report Id = Configuration
+  sConfigReport[1] = sUSBResponse[1];       // Echo the operation requested
+  sConfigReport[2] = sUSBResponse[2];       // Echo the EEPROM address requested
+  sConfigReport[3] = nLength;               // Number of bytes actually read/written
+  bConfigReplyPending = TRUE;               // serviceConfigReply() sends it (a newer request replaces it)
+}
+
+void processUSBOutputReport()
+{
+  switch (sUSBResponse[0])                  // Report Id
+  {
+    case REPORT_ID_CONFIG:                  // Host is reading or writing the configuration
+      processConfigRequest();
+      break;
+    case REPORT_ID_KEYBOARD:                // Host is setting the keyboard LEDs (ignored)
+    default:
+      break;
+  }
+}
+
+unsigned int getPulseTicks(byte nEEPROMAddress, byte nDefault)
+{
+  byte nUnits;
+  nUnits = EEPROM_Read(nEEPROMAddress);
+  if (nUnits == 0x00 || nUnits == 0xFF) // If not configured
+    nUnits = nDefault;
+  return (unsigned int)nUnits * SWITCH_PULSE_UNIT_TICKS;
+}
+
+// Switch pulses are ended by a software timer (see runSoftwareTimers) so that
+// IR and USB keep being serviced while a switch is closed. A repeated command
+// restarts the pulse, and the On and Off commands cancel it. The timer is
+// always stopped before the switch is changed so that it cannot undo the change.
+void performLocalIRKFunction()
+{
+  switch (usbCommand.s.yy)
+  {
+    case CMD_PRESS_POWER_SWITCH:
+      POWER_SWITCH = ON;
+      startTimer(TIMER_POWER_SWITCH, getPulseTicks(EEPROM_POWER_PULSE, DEFAULT_SWITCH_PULSE));
+      break;
+    case CMD_HOLD_POWER_SWITCH:
+      POWER_SWITCH = ON;
+      startTimer(TIMER_POWER_SWITCH, getPulseTicks(EEPROM_POWER_HOLD, DEFAULT_POWER_HOLD));
+      break;
+    case CMD_PRESS_RESET_SWITCH:
+      RESET_SWITCH = ON;
+      startTimer(TIMER_RESET_SWITCH, getPulseTicks(EEPROM_RESET_PULSE, DEFAULT_SWITCH_PULSE));
+      break;
+    case CMD_PRESS_AUX_SWITCH:
+      AUX_SWITCH = ON;
+      startTimer(TIMER_AUX_SWITCH, getPulseTicks(EEPROM_AUX_PULSE, DEFAULT_SWITCH_PULSE));
+      break;
+    case CMD_POWER_SWITCH_ON:
+      startTimer(TIMER_POWER_SWITCH, 0);
+      POWER_SWITCH = ON;
+      break;
+    case CMD_RESET_SWITCH_ON:
+      startTimer(TIMER_RESET_SWITCH, 0);
+      RESET_SWITCH = ON;
+      break;
+    case CMD_AUX_SWITCH_ON:
+      startTimer(TIMER_AUX_SWITCH, 0);
+      AUX_SWITCH = ON;
+      break;
+    case CMD_POWER_SWITCH_OFF:
+      startTimer(TIMER_POWER_SWITCH, 0);
+      POWER_SWITCH = OFF;
+      break;
+    case CMD_RESET_SWITCH_OFF:
+      startTimer(TIMER_RESET_SWITCH, 0);
+      RESET_SWITCH = OFF;
+      break;
+    case CMD_AUX_SWITCH_OFF:
+      startTimer(TIMER_AUX_SWITCH, 0);
+      AUX_SWITCH = OFF;
+      break;
+    case CMD_INIT_USB:
+      disableUSB();         // serviceUSB() re-enables it if USB is powered
+      break;
+    case CMD_SET_BACKLIGHT_OFF:   // User wants backlight temporarily OFF
+      nConfigBacklightDelay = 0x00;
+      actionBacklightDelay();
+      break;
+    case CMD_SET_BACKLIGHT_ON:    // User wants backlight temporarily ON
+      nConfigBacklightDelay = 0xFF;
+      actionBacklightDelay();
+      break;
+    case CMD_SET_DEBUG_OFF:
+      bDebugMode = OFF;
+      bShowingHistory = FALSE;
+      updateLCD();
+      break;
+    case CMD_SET_DEBUG_ON:
+      bDebugMode = ON;
+      break;
+    case CMD_SET_DEVICE_ADDRESS:
+      break;    // Do nothing, user is setting the IRK! device address
+    default:
+      break;
+  }
+}
+
+void executeCommand()
+{
+  if (!bLowPowerMode)
+  {
+    ACTIVITY_LED = ON;
+    startTimer(TIMER_ACTIVITY_LED, ACTIVITY_LED_TICKS);
+  }
+  switch (usbCommand.s.ux.byte & 0xF0)   // 0xUM (Usage 4 bits, Modifiers 4 bits)
+  {
+    case USAGE_KEYBOARD:
+      sendUSBKeystroke();
+      break;
+    case USAGE_SYSTEM_CONTROL:
+      sendUSBSystemControlCommand();
+      break;
+    case USAGE_CONSUMER_DEVICE:
+      sendUSBConsumerDeviceCommand();
+      break;
+    case USAGE_LOCAL_IRK_FUNCTION:
+      performLocalIRKFunction();
+      break;
+    default:
+      break;
+  }
+}
+
+void gotoResetState(byte nReason)
+{
+  nState = STATE_IR_RESET;
+  nByte = 0;
+  nBit = 0;
+  nResetCount++;
+  if (nReason != RESET_CAPTURE_RESTART && nResetsSinceFrame != 0xFF)
+    nResetsSinceFrame++;    // Noise or a corrupted frame
+  if (bTelemetryOn && nResetReasonCount[nReason] != 0xFF)
+    nResetReasonCount[nReason]++;
+}
+
+void disableInfraredCapture()
+{
+  CCP2IE_bit = 0;           // Disable CCP2 interrupts
+}
+
+void enableInfraredCapture()
+{
+  CCP2IE_bit = 0;           // Disable CCP2 interrupts while resetting capture mode
+  CCP2IF_bit = 0;           // Reset CCP2 interrupt flag
   CCP2CON = 0b00000000;     // Reset the CCP2 module
   CCP2CON = 0b00000100;     // Set CCP2 to capture the next falling edge
   TMR1H = 0;                // Prime Timer1 high byte
   TMR1L = 0;                // Set Timer1 low and high bytes now
-  gotoResetState();
+  gotoResetState(RESET_CAPTURE_RESTART);
   CCP2IE_bit = 1;           // Enable CCP2 interrupts
 }
 
@@ -1443,6 +2788,7 @@ void transmitInfraredCommand()
 {
   byte i;
   ACTIVITY_LED = ON;
+  TMR2IE_bit = 0;                   // Hold LCD writes so they don't stretch the IR timing
   disableInfraredCapture();         // Disable IR capture while transmitting...
   irCommand.s.nAddress           =  nConfigDeviceAddress;
   irCommand.s.nAddressInverted   = ~nConfigDeviceAddress;
@@ -1459,6 +2805,7 @@ void transmitInfraredCommand()
     transmitInfraredByte(irCommand.b[i]);
   }
   transmitInfraredShortMark();      // Send a short mark to end
+  startLCDQueue();                  // Resume LCD writes
   Delay_ms(100);                    // Pause between transmitted IR commands
   enableInfraredCapture();
   ACTIVITY_LED = OFF;
@@ -1466,9 +2813,9 @@ void transmitInfraredCommand()
 
 void defineCustomCharacters()
 {
-  // Symbol #0 is not being defined because to use it would mean putting
-  // null characters in the buffers to be written to the LCD. That's ok but
-  // it makes null-terminated string handling more difficult.
+  // Symbol #0 is not being defined here because it is the status glyph,
+  // which is redrawn by updateStatusGlyph() and displayed using its alias
+  // STATUS_GLYPH (0x08) so that null-terminated strings still work.
 
   // Note that the Character Generator RAM (CGRAM) expects symbols to be defined
   // as 8 rows of 8 bits, but the LCD display cell size is only 8 rows of 5 bit
@@ -1542,6 +2889,32 @@ void defineCustomCharacters()
   Lcd_Cmd(_LCD_RETURN_HOME);
 }
 
+void enableButtons()
+{
+  nButtonEventHead = 0;
+  nButtonEventTail = 0;
+  nIgnoredButton = NO_BUTTON;
+  nHeldButton = NO_BUTTON;
+  startTimer(TIMER_DEBOUNCE, 1);  // Buttons already pressed are reported at the next tick
+  cButtons = 0;
+  IOCIF_bit = 0;
+  INT0IF_bit = 0;
+  INT1IF_bit = 0;
+  INT2IF_bit = 0;
+  INT0IE_bit = 1;
+  INT1IE_bit = 1;
+  INT2IE_bit = 1;
+  IOCIE_bit = 1;
+}
+
+void disableButtons()
+{
+  IOCIE_bit = 0;
+  INT0IE_bit = 0;
+  INT1IE_bit = 0;
+  INT2IE_bit = 0;
+}
+
 void Prolog()
 {
   byte i;
@@ -1590,6 +2963,15 @@ void Prolog()
 //  while (!ACTLOCK_bit);   // Wait until HFINTOSC is successfully tuned
   
   cFlags = 0;             // Reset all flags
+  cUSBFlags = 0;
+  nFrameHistoryNext = 0;
+  nFrameHistoryCount = 0;
+  nFrameHistoryView = 0;
+  nResetsSinceFrame = 0;
+  nResetsBeforeFrame = 0;
+  nStatusGlyph = 0xFF;                // Draw the status glyph the first time round
+  nUSBState = USB_STATE_DETACHED; // Prolog() or serviceUSB() enables USB when it sees USB power
+  for (i = 0; i < BOOT_PHASES; i++) wBootTicks[i] = 0;
   for (i=0; i < sizeof irCommand.b; i++) irCommand.b[i] = 0;
   usbCommand.uxyy = 0;
 
@@ -1601,21 +2983,23 @@ void Prolog()
                           //     IRK will work in Low Speed only
 
 //----------------------------------------------------------------------------
-// Set up Timer0 for LCD display backlight timeouts
+// Set up Timer0 as the 1 ms system tick (wTicks and the software timers)
 //----------------------------------------------------------------------------
 
-  T0CON   = 0b00000111;
-//            x              0   = TNR0ON: Timer0 off
+  T0CON   = 0b00000010;
+//            x              0   = TNR0ON: Timer0 off (until interrupts are enabled)
 //             x             0   = T08BIT: Timer0 is in 16-bit mode
 //              x            0   = T0CS:   Timer0 clock source is FOSC/4
 //               x           0   = T0SE:   Timer0 source edge select (ignored)
 //                x          0   = PSA:    Timer0 prescaler assigned
-//                 xxx       111 = TOPS:   Timer0 prescaler (1:256)
+//                 xxx       010 = TOPS:   Timer0 prescaler (1:8)
 
-// Timer0 tick rate at 24 MHz MCU clock = 24 MHz clock/4/256 = 23437.5 Hz
-//       We can set a 1 second delay by storing 65535-23437=42098 in TMR0H:TMR0L
-// Timer0 tick rate at 48 MHz MCU clock = 48 MHz clock/4/256 = 46875 Hz
-//       We can set a 1 second delay by storing 65535-46875=18661 in TMR0H:TMR0L
+// Timer0 tick rate at 24 MHz MCU clock = 24 MHz clock/4/8 = 750 kHz
+//       We can set a 1 ms delay by storing 65536-750=64786 in TMR0H:TMR0L
+// Timer0 tick rate at 48 MHz MCU clock = 48 MHz clock/4/8 = 1.5 MHz
+//       We can set a 1 ms delay by storing 65536-1500=64036 in TMR0H:TMR0L
+  for (i = 0; i < SOFTWARE_TIMERS; i++) wTimers[i] = 0;
+  wTicks = 0;
 
 //----------------------------------------------------------------------------
 // Set up Timer1 for IR signal capture timings using CCP2 (permanently turned on)
@@ -1636,26 +3020,63 @@ void Prolog()
 // Set up Timer2 for IR signal transmission (PWM)
 //----------------------------------------------------------------------------
 
-// ...this is done via library calls, so it is not configured here
+// ...this is done via library calls, so it is not configured here, except that
+// its postscaler is also used to pace the LCD write queue (see startLCDQueue)
 
 //----------------------------------------------------------------------------
-// Set up Timer3 for key repeats (turned on when a front panel key is long-pressed)
+// Set up Timer3 as a free-running counter for timing code (getTimer3Count)
 //----------------------------------------------------------------------------
 
-  T3CON   = 0b00110010;
+  T3CON   = 0b00110011;
 //            xx             00 = TMR3CS: Timer3 clock source is instruction clock (Fosc/4)
 //              xx           11 = TMR3PS: Timer3 prescale value is 1:8
 //                x          0  = SOSCEN: Secondary Oscillator disabled
 //                 x         0  = T3SYNC: Ignored because TMR3CS = 0x
 //                  x        1  = RD16:   Enables register read/write of Timer3 in one 16-bit operation
-//                   x       0  = TMR3ON: Timer3 is off
+//                   x       1  = TMR3ON: Timer3 is on
 
 //----------------------------------------------------------------------------
 // Let the interrupts begin
 //----------------------------------------------------------------------------
 
-  PEIE_bit = 1;           // Enable peripheral interrupts
-  GIE_bit = 1;            // Enable global interrupts
+  IPEN_bit = 1;           // Enable interrupt priorities...
+  IPR1 = 0;               // ...with every peripheral at low priority...
+  IPR2 = 0;
+  IPR3 = 0;
+  CCP2IP_bit = 1;         // ...except IR capture (see interrupt)
+  TMR0IP_bit = 0;         // The system tick...
+  IOCIP_bit = 0;          // ...and the buttons are low priority too
+  INT1IP_bit = 0;
+  INT2IP_bit = 0;         // (INT0 is always high priority)
+  PEIE_bit = 1;           // Enable low priority interrupts (GIEL)
+  GIE_bit = 1;            // Enable high priority interrupts (GIEH)
+
+  TMR0H = HiByte(ONE_MILLISECOND);  // Set high-byte of 16-bit count
+  TMR0L = LoByte(ONE_MILLISECOND);  // Set low-byte and write all 16 bits to Timer0
+  TMR0IF_bit = 0;         // Clear the Timer0 interrupt flag
+  TMR0IE_bit = 1;         // Enable system tick interrupts
+  TMR0ON_bit = 1;         // Start the system tick (and the boot phase timings)
+
+//----------------------------------------------------------------------------
+// Retrieve this device's configuration from EEPROM (a few us, and the IR
+// decoder needs the device address)
+//----------------------------------------------------------------------------
+
+  loadConfig();
+
+//----------------------------------------------------------------------------
+// Set up capture mode (to receive IR input signals)
+//----------------------------------------------------------------------------
+
+  enableInfraredCapture();
+
+//----------------------------------------------------------------------------
+// Attach to USB now, so that the host can enumerate IRK! (in interrupt_low)
+// while the LCD is being initialised
+//----------------------------------------------------------------------------
+
+  if (USB_POWER_GOOD) attachUSB();
+  wBootTicks[BOOT_PHASE_USB] = getTicks();
 
 //----------------------------------------------------------------------------
 // Set up Pulse Width Modulation (to transmit IR output signals)
@@ -1663,47 +3084,147 @@ void Prolog()
 
   PWM1_Init(IR_MODULATION_FREQ);
   PWM1_Set_Duty(DUTY_CYCLE);  // 64/256 = 1:4, 128/256 = 1:2
+  nLCDQueueHead = 0;
+  nLCDQueueTail = 0;
+  nLCDWaitTicks = 0;
+  cLCDFlags = 0;
 
 //----------------------------------------------------------------------------
-// Set up LCD display
+// Set up LCD display (Lcd_Init blocks for tens of ms, so it comes after USB)
 //----------------------------------------------------------------------------
 
   Lcd_Init();                         // Initialize LCD
   defineCustomCharacters();
-  Lcd_Cmd(_LCD_CLEAR);                // Clear display
-  Lcd_Cmd(_LCD_CURSOR_OFF);           // Cursor off
-  Lcd_Out(1,1,_TEXT("IRK! v" IRK_VERSION));
+  Lcd_Cmd(_LCD_CURSOR_OFF);           // Cursor off (the last blocking LCD call)
+  clearLCD();                         // Clear display (queued from now on)
+  lcdOutText(1,"IRK! v" IRK_VERSION);
+  if (nUSBState == USB_STATE_ENABLING)
+  {
+    enableBacklight();                // Conditionally turn on LCD backlight
+    lcdOutText(2,"Enabling USB    ");
+  }
+  wBootTicks[BOOT_PHASE_LCD] = getTicks();
 
   if (((PORTB & 0b11110111) ^ 0b11110111))     // If any button is pressed (low)
   {  // ...then (probably) the ICSP programmer is still connected
      // which is the same as pressing and holding a button or two
-    Lcd_Out(2,1,_TEXT("Release buttons!" ));
+    lcdOutText(2,"Release buttons!");
     while (((PORTB & 0b11110111) ^ 0b11110111));
   }
 
-  TMR3IE_bit = 1;         // Enable key repeat timer interrupts
-
 //----------------------------------------------------------------------------
-// Retrieve this device's configuration from EEPROM
+// Set up button interrupts
 //----------------------------------------------------------------------------
 
-  nConfigDeviceAddress = EEPROM_Read(0);    // This IRK! device's IR address
-  loadBacklightDelay();
+  INTEDG0_bit = 0;        // INT0 (TEACH) on falling edge (button pressed)
+  INTEDG1_bit = 0;        // INT1 (CTL)   on falling edge
+  INTEDG2_bit = 0;        // INT2 (ALT)   on falling edge
+  IOCB = 0b11110000;      // Interrupt on change of SHIFT, OK, UP and DOWN
+  enableButtons();
+}
 
-//----------------------------------------------------------------------------
-// Set up capture mode (to receive IR input signals)
-//----------------------------------------------------------------------------
+// While the host is suspended there is no USB traffic to keep up with, so the
+// CPU is switched from the 48 MHz PLL output to the 16 MHz HFINTOSC that feeds
+// it. The PLL itself is left running (so the USB module can be woken at once)
+// but everything the CPU and its timers do costs a third of the clock edges.
+// Timer0 and Timer1 are corrected for the slower clock (see interrupt_low and
+// interrupt) and anything with software delays (IR transmission, USB remote
+// wakeup signalling and the LCD) is only done after switching back to 48 MHz.
+void useSlowClock()
+{
+  if (!SLOW_CLOCK_USABLE) return; // 16 MHz would be no slower, or Timer1 could not be scaled
+  SCS1_bit = 1;             // OSCCON.SCS = 1x: Run from HFINTOSC (16 MHz)
+  bSlowClock = TRUE;
+}
 
-  enableInfraredCapture();
+void useFastClock()
+{
+  SCS1_bit = 0;             // OSCCON.SCS = 00: Run from the primary clock (48 MHz PLL)
+  while (!OSTS_bit);        // Wait until the primary clock is being used
+  bSlowClock = FALSE;
+  if (bLowPowerMode)        // The tick stopped itself once the clock was slow, so restart
+    TMR0ON_bit = 1;         // ...it to wake runUSBTask() until IR capture is idle again
 }
 
-void interpretInfraredCommand(void)
+// While the host is suspended IRK! tries to draw as little current as it can:
+// the LCD and its backlight are turned off, the front panel is ignored, the
+// CPU is slowed to 16 MHz and put into Idle mode between interrupts. The system
+// clock is left running in Idle mode so that Timer1 keeps counting and CCP2
+// still latches the time of the first IR edge in hardware. The edge is
+// therefore timed correctly even though the CPU is woken by it.
+void enterLowPowerMode()
+{
+  bLowPowerMode = TRUE;
+  ACTIVITY_LED = OFF;
+  startTimer(TIMER_BACKLIGHT, 0);    // The tick stops itself once any switch pulse has
+  startTimer(TIMER_ACTIVITY_LED, 0); // ...ended, so Idle mode is not woken every ms
+  disableButtons();         // Ignore the front panel
+  LCD_BACKLIGHT = 1;        // Turn backlight off (0=On, 1=Off)
+  lcdCmd(_LCD_TURN_OFF);    // Blank the display (its contents are kept)
+  startTelemetry(0);        // The host cannot read it (and Timer3 will run slow)
+  // runUSBTask() slows the clock once IR capture is idle
+}
+
+void exitLowPowerMode()
+{
+  bLowPowerMode = FALSE;
+  useFastClock();           // Back to full speed before anything else
+  TMR0ON_bit = ON;          // Restart the system tick
+  enableButtons();
+  lcdCmd(_LCD_TURN_ON);     // Unblank the display
+  actionBacklightDelay();   // Restore the backlight to its configured state...
+  enableBacklight();        // ...and show the user that IRK! is awake again
+  if (bDebugMode)
+    showDebugInfo();
+  else
+    updateLCD();            // Show anything received while the host was asleep
+}
+
+// The main loop calls this whenever it has been round the USB task, so that
+// the CPU sits in Idle mode instead of spinning until an interrupt brings it
+// more work: an IR edge (CCP2), USB, the 1 ms tick (which also paces
+// everything main() polls), the LCD queue (Timer2) or a button (IOC/INTx).
+// Idle mode keeps the system clock running, so waking takes no oscillator
+// start-up time and CCP2 latches IR edges in hardware regardless. The only
+// extra IR latency is the few instructions below that run with GIE clear
+// after waking, which the 'I' telemetry record (dddd) includes.
+void waitForInterrupt()
+{
+  unsigned int wStartCount;
+
+  GIE_bit = 0;              // Stop an interrupt sneaking in between the test and the SLEEP
+  if (!bInfraredInterruptPending && nButtonEventHead == nButtonEventTail)
+  {
+    wStartCount = getTimer3Count();
+    IDLEN_bit = 1;          // SLEEP enters Idle mode (peripherals keep running)
+    asm sleep;              // Wait for any enabled interrupt
+    if (bTelemetryOn)       // Timer3 cannot wrap as the tick wakes us every ms
+    {
+      ulIdleTotal += getTimer3Count() - wStartCount;
+      wIdleCount++;
+    }
+  }
+  GIE_bit = 1;              // Now service whatever woke us
+}
+
+byte checkInfraredCommand(void)
 {
   if ((irCommand.s.nAddress   != nConfigDeviceAddress) &&                 // Address byte matches this device..
-      (irCommand.s.nAddress   != BROADCAST_ADDRESS))              return; // ...or is a broadcast?
-  if (!(irCommand.s.nAddress   ^ irCommand.s.nAddressInverted))   return; // Address byte valid?
-  if (!(irCommand.s.nModifiers ^ irCommand.s.nModifiersInverted)) return; // Modifier byte valid?
-  if (!(irCommand.s.nCommand   ^ irCommand.s.nCommandInverted))   return; // Key byte valid?
+      (irCommand.s.nAddress   != BROADCAST_ADDRESS))              return FRAME_NOT_FOR_US;    // ...or is a broadcast?
+  if (!(irCommand.s.nAddress   ^ irCommand.s.nAddressInverted))   return FRAME_BAD_ADDRESS;   // Address byte valid?
+  if (!(irCommand.s.nModifiers ^ irCommand.s.nModifiersInverted)) return FRAME_BAD_MODIFIERS; // Modifier byte valid?
+  if (!(irCommand.s.nCommand   ^ irCommand.s.nCommandInverted))   return FRAME_BAD_COMMAND;   // Key byte valid?
+  return FRAME_OK;
+}
+
+void interpretInfraredCommand(void)
+{
+  byte nOutcome;
+
+  nOutcome = checkInfraredCommand();
+  recordFrameHistory(nOutcome);
+  if (bTelemetryOn) recordTelemetryFrame(nOutcome);
+  if (nOutcome != FRAME_OK) return;
                             // The infrared command is now valid, so...
   usbCommand.uxyy = irCommand.s.nModifiers << 8 | irCommand.s.nCommand;   // Build USB command from incoming IR command
   if (bDebugMode)
@@ -1732,6 +3253,20 @@ void appendBit(void)
 #define LARGEST(x)  MICROSECONDS(((x) + WIDTH_ERROR_MARGIN))
 #define IS_PULSE_WIDTH_NEAR(x) ((nPulseWidth > SMALLEST(x))  &  (nPulseWidth < LARGEST(x)))
                               
+// The clock must not be slowed while a pulse is being timed, or that pulse would
+// be measured partly at each speed. Once Timer1 has counted past the longest
+// valid pulse since the last edge, whatever it is timing is noise anyway.
+#define IR_IDLE_GAP LARGEST(WIDTH_LONG)
+
+byte isInfraredIdle()
+{
+  unsigned int w;
+  if (bInfraredInterruptPending || nState != STATE_IR_RESET) return FALSE;
+  Lo(w) = TMR1L;            // Reading TMR1L also latches TMR1H (RD16 = 1)
+  Hi(w) = TMR1H;
+  return w > IR_IDLE_GAP;
+}
+
 void processInfraredInterrupt(void)
 {
   switch (nState)
@@ -1743,7 +3278,7 @@ void processInfraredInterrupt(void)
       }
       else
       {
-        gotoResetState();
+        gotoResetState(RESET_BAD_TRAINING_PULSE);
       }
       break;
     case STATE_IR_TRAINING_RECEIVED:
@@ -1753,7 +3288,7 @@ void processInfraredInterrupt(void)
       }
       else
       {
-        gotoResetState();
+        gotoResetState(RESET_BAD_TRAINING_SILENCE);
       }
       break;
     case STATE_IR_RECEIVING_BITS:
@@ -1761,7 +3296,7 @@ void processInfraredInterrupt(void)
       {
         if (nPulseWidth > LARGEST(WIDTH_SHORT))
         {
-          gotoResetState();
+          gotoResetState(RESET_MARK_TOO_LONG);
         }
         else
         {
@@ -1771,7 +3306,7 @@ void processInfraredInterrupt(void)
       {
         if (nPulseWidth > LARGEST(WIDTH_LONG))
         {
-          gotoResetState();        // Too long, so it is not a 1 bit
+          gotoResetState(RESET_SPACE_TOO_LONG); // Too long, so it is not a 1 bit
         }
         else if (nPulseWidth > SMALLEST(WIDTH_LONG))
         {
@@ -1788,11 +3323,12 @@ void processInfraredInterrupt(void)
         }
         else
         {
-          gotoResetState();       // Too short, so it is not a 0 bit
+          gotoResetState(RESET_SPACE_TOO_SHORT); // Too short, so it is not a 0 bit
         }
       }
       break;
     case STATE_IR_COMMAND_RECEIVED:
+      if (bSlowClock) useFastClock(); // Acting on it may need USB or IR timings
       disableInfraredCapture();   // Disable infrared input while we...
       interpretInfraredCommand(); // ...process the command just received
       enableInfraredCapture();    // ...and go to STATE_IR_RESET
@@ -1801,10 +3337,136 @@ void processInfraredInterrupt(void)
   }
 }
 
-void interrupt()            // High priority interrupt service routine
+void postButtonEvent(byte nEvent)     // Called by interrupt_low() only
 {
-  USB_Interrupt_Proc();     // Always give the USB module first opportunity to process
-  // The next most important interrupt is from the Infrared receiver...
+  byte nNext;
+
+  nNext = (nButtonEventTail + 1) & (BUTTON_EVENT_QUEUE_SIZE - 1);
+  if (nNext != nButtonEventHead)      // Drop the event if the queue is full
+  {
+    buttonEvents[nButtonEventTail] = nEvent;
+    nButtonEventTail = nNext;
+  }
+}
+
+void scanButtons()                    // Called by interrupt_low() only
+{
+  byte cPressed;
+  byte cChanged;
+  byte cMask;
+  byte nButton;
+
+  cPressed = ~PORTB & BUTTON_MASK;    // Reading PORTB also ends an interrupt-on-change mismatch
+  if (wTimers[TIMER_DEBOUNCE]) return; // Contacts may still be bouncing
+  cChanged = cPressed ^ cButtons;
+  if (!cChanged) return;
+  cMask = 0b00000001;
+  for (nButton = 0; nButton < 8; nButton++)
+  {
+    if (cChanged & cMask)
+    {
+      if (cPressed & cMask)
+      {
+        postButtonEvent(BUTTON_PRESSED | nButton);
+        nHeldButton = nButton;
+        wTimers[TIMER_KEY_REPEAT] = wKeyRepeatDelayTicks;  // Time before starting key repeat
+      }
+      else
+      {
+        postButtonEvent(BUTTON_RELEASED | nButton);
+      }
+    }
+    cMask <<= 1;
+  }
+  cButtons = cPressed;
+  wTimers[TIMER_DEBOUNCE] = BUTTON_DEBOUNCE_TICKS;
+}
+
+byte runSoftwareTimers()              // Called by interrupt_low() every tick, returns the number still running
+{
+  byte i;
+  byte nRunning;
+
+  nRunning = 0;
+  for (i = 0; i < SOFTWARE_TIMERS; i++)
+  {
+    if (wTimers[i] == 0) continue;    // Timer is stopped
+    if (--wTimers[i] == 0)            // If timer has just expired
+    {
+      switch (i)
+      {
+        case TIMER_BACKLIGHT:
+          if (--nBacklightDelay <= 0)   // Decrement seconds remaining with backlight on
+            LCD_BACKLIGHT = 1;          // Turn backlight off (0=On, 1=Off)
+          else
+            wTimers[TIMER_BACKLIGHT] = TICKS_PER_SECOND;
+          break;
+        case TIMER_ACTIVITY_LED:
+          ACTIVITY_LED = OFF;
+          break;
+        case TIMER_DEBOUNCE:
+          if (IOCIE_bit)                // If the buttons are in use
+            scanButtons();              // Catch changes made while the contacts settled
+          break;
+        case TIMER_KEY_REPEAT:
+          if (nHeldButton != NO_BUTTON && (cButtons & (1 << nHeldButton)))
+          {
+            if (nButtonEventHead == nButtonEventTail) // Don't let repeats pile up
+              postButtonEvent(BUTTON_HELD | nHeldButton);
+            wTimers[TIMER_KEY_REPEAT] = KEY_REPEAT_INTERVAL_TICKS;
+          }
+          else
+          {
+            nHeldButton = NO_BUTTON;
+          }
+          break;
+        case TIMER_POWER_SWITCH:
+          POWER_SWITCH = OFF;
+          break;
+        case TIMER_RESET_SWITCH:
+          RESET_SWITCH = OFF;
+          break;
+        case TIMER_AUX_SWITCH:
+          AUX_SWITCH = OFF;
+          break;
+      }
+    }
+    if (wTimers[i]) nRunning++;       // Still running (or restarted)
+  }
+  return nRunning;
+}
+
+void watchSetupPacket()               // Called by interrupt_low() only
+{
+  byte * pBD;
+  byte * pSetup;
+  unsigned int wAddress;
+  pBD = BANK4_RESERVED_FOR_USB;       // EP0 OUT (even) buffer descriptor
+  if ((UCFG & 0b00000011) == 0b01 ||  // If EP0 OUT is ping-ponged then USTAT.PPBI
+      (UCFG & 0b00000011) == 0b10)    // says which descriptor was used
+    pBD += (USTAT & 0b00000010) << 1;
+  if (((pBD[0] >> 2) & 0x0F) != USB_PID_SETUP) return;
+  Lo(wAddress) = pBD[2];              // Where the packet is
+  Hi(wAddress) = pBD[3];
+  pSetup = (byte *) wAddress;
+  if (pSetup[0] != 0x00) return;      // Only standard requests to the device itself
+  if (pSetup[2] != USB_FEATURE_REMOTE_WAKEUP || pSetup[3] != 0) return;
+  if (pSetup[1] == USB_REQUEST_SET_FEATURE) bRemoteWakeupEnabled = TRUE;
+  if (pSetup[1] == USB_REQUEST_CLEAR_FEATURE) bRemoteWakeupEnabled = FALSE;
+}
+
+// Uncomment to drive RA6 high while interrupt() runs, so that the IR capture
+// latency can be seen on a logic analyzer. RA6 is also the AUX switch.
+// #define DEBUG_INTERRUPT_PIN
+
+void interrupt()            // High priority interrupt service routine (IR only)
+{
+  unsigned int wElapsed;
+  byte i;
+
+#ifdef DEBUG_INTERRUPT_PIN
+  LATA6_bit = 1;
+#endif
   if (CCP2IF_bit)           // If capture event (rise/fall) on the CCP2 pin
   {
     Hi(nPulseWidth) = CCPR2H; // Remember the elapsed time since last event
@@ -1812,46 +3474,194 @@ void interrupt()            // High priority interrupt service routine
     nRiseOrFall = CCP2CON;  // Save the rise or fall detection mode
     CCP2M0_bit ^= 1;        // Toggle rise or fall detection
 //  LATA6_bit = CCP2M0_bit; // Debug CCP2 by putting a logic analyzer on RA6
+    if (bTelemetryOn)       // Measure how long ago the edge was captured
+    {
+      Lo(wElapsed) = TMR1L; // Reading TMR1L also latches TMR1H (RD16 = 1)
+      Hi(wElapsed) = TMR1H;
+      wElapsed -= nPulseWidth;
+      if (wElapsed > wLongestCaptureDelay) wLongestCaptureDelay = wElapsed;
+    }
     TMR1H = 0;              // Set high-byte of 16-bit time
     TMR1L = 0;              // Set low-byte and write all 16 bits to Timer1
+    if (bSlowClock)         // Timer1 counts SLOW_CLOCK_DIVISOR times slower, so scale
+    {                       // ...the width back to full speed units (MICROSECONDS)
+      if (nPulseWidth > 0xFFFF / SLOW_CLOCK_DIVISOR)
+        nPulseWidth = 0xFFFF;
+      else
+      {
+        wElapsed = nPulseWidth;
+        for (i = 1; i < SLOW_CLOCK_DIVISOR; i++) // Adds rather than a library multiply
+          nPulseWidth += wElapsed;
+      }
+    }
     bInfraredInterruptPending = 1; // Indicate capture event detected
     CCP2IF_bit = 0;         // Allow the next CCP2 interrupt to occur
   }
+  if (INT0IF_bit && INT0IE_bit) // INT0 (TEACH) cannot be made low priority...
+  {
+    bButtonEdgePending = TRUE;  // ...so leave it for the next tick to scan
+    TMR0ON_bit = 1;             // (the tick may have stopped in low power mode)
+    INT0IF_bit = 0;
+  }
+#ifdef DEBUG_INTERRUPT_PIN
+  LATA6_bit = 0;
+#endif
+}
+
+void interrupt_low()        // Low priority interrupt service routine
+{
+  unsigned int wStartCount;
+  unsigned int wElapsed;
+
+  Lo(wStartCount) = TMR3L;  // Reading TMR3L also latches TMR3H (RD16 = 1)
+  Hi(wStartCount) = TMR3H;
+  // IRK! handles USB suspend and resume itself (as the Microchip USB stack does)
+  // so that it knows when the host is asleep and needs a remote wakeup...
+  if (IDLEIF_bit && IDLEIE_bit) // If no bus activity for 3 ms (host has suspended the bus)
+  {
+    ACTVIE_bit = 1;         // Interrupt when bus activity resumes
+    IDLEIF_bit = 0;
+    SUSPND_bit = 1;         // Put the USB module into its low power state
+    bUSBSuspended = TRUE;
+    wSuspendTicks = wTicks;
+  }
+  if (ACTVIF_bit && ACTVIE_bit) // If bus activity while suspended (host has resumed the bus)
+  {
+    SCS1_bit = 0;           // Back to 48 MHz before the host starts talking again
+    bSlowClock = FALSE;
+    SUSPND_bit = 0;         // Wake the USB module
+    ACTVIE_bit = 0;
+    while (ACTVIF_bit) ACTVIF_bit = 0; // ACTVIF only clears once the module is awake
+    bUSBSuspended = FALSE;
+  }
+  if (URSTIF_bit) bRemoteWakeupEnabled = FALSE; // A bus reset disables remote wakeup
+  if (TRNIF_bit && (USTAT & 0b01111100) == 0) // If an EP0 OUT transaction has completed
+    watchSetupPacket();     // ...see whether it changes remote wakeup before the library does
+  USB_Interrupt_Proc();     // Always give the USB module first opportunity to process
   // Technically any or all of these interrupts can be asserted simultaneously,
   // but to ensure quick exit from the interrupt handler we only process
-  // the most important and let interrupt() be driven again for any interrupts
-  // that remain pending. That is why "else if" is used...
-  else if (TMR3IF_bit)      // If it's a Timer3 interrupt
-  {                         // 22.89 ticks/sec @48 MHz, 11.44 ticks/sec @24 MHz
-    bKeyRepeatPending = TRUE;  // Indicate Timer3 rollover
-    nKeyRepeatDelay--;      // Decrement delay before key repeat action starts
-    TMR3IF_bit = 0;         // Clear the Timer3 interrupt flag
-  }
-  else if (TMR0IF_bit)      // If backlight timeout interrupt
-  {
-    nBacklightDelay--;      // Decrement seconds remaining with backlight on
-    if (nBacklightDelay == 0)
+  // the most important and let interrupt_low() be driven again for any
+  // interrupts that remain pending. That is why "else if" is used...
+  if (TMR0IF_bit && TMR0IE_bit) // If it's the 1 ms system tick
+  {
+    if (bSlowClock)
     {
-      LCD_BACKLIGHT = 1;    // Turn backlight off (0=On, 1=Off)
-      TMR0ON_bit = 0;       // Turn off Timer0
+      TMR0H = HiByte(ONE_MILLISECOND_SLOW);
+      TMR0L = LoByte(ONE_MILLISECOND_SLOW);
+    }
+    else
+    {
+      TMR0H = HiByte(ONE_MILLISECOND);  // Set high-byte of 16-bit count
+      TMR0L = LoByte(ONE_MILLISECOND);  // Set low-byte and write all 16 bits to Timer0
     }
-    TMR0H = HiByte(ONE_SECOND);  // Set high-byte of 16-bit count
-    TMR0L = LoByte(ONE_SECOND);  // Set low-byte and write all 16 bits to Timer0
     TMR0IF_bit = 0;         // Clear the Timer0 interrupt flag
+    wTicks++;
+    if (!runSoftwareTimers() && bLowPowerMode && (bSlowClock || !SLOW_CLOCK_USABLE))
+      TMR0ON_bit = 0;       // Nothing left to time while the host is suspended
+    if ((cButtons || bButtonEdgePending) && IOCIE_bit) // While a button is down, watch for its
+    {                       // release (RB0-2 only interrupt when pressed), and scan INT0 edges
+      bButtonEdgePending = FALSE;
+      scanButtons();
+    }
+  }
+  else if (TMR2IF_bit && TMR2IE_bit) // If it's time to send the next nibble to the LCD
+  {
+    TMR2IF_bit = 0;         // Clear the Timer2 interrupt flag
+    if (nLCDWaitTicks)
+    {
+      nLCDWaitTicks--;      // LCD is still busy with a slow instruction
+    }
+    else if (nLCDQueueHead == nLCDQueueTail)
+    {
+      TMR2IE_bit = 0;       // Nothing left to send
+    }
+    else
+    {
+      cLCDNibble = cLCDQueue[nLCDQueueHead];
+      if (cLCDNibble == LCD_INSTRUCTION && !bLCDInstruction)
+      {
+        bLCDInstruction = TRUE; // The next byte is an instruction
+        nLCDQueueHead = (nLCDQueueHead + 1) & (LCD_QUEUE_SIZE - 1);
+      }
+      else
+      {
+        if (bLCDLowNibble)
+          cLCDNibble <<= 4;
+        LCD_RS = !bLCDInstruction;
+        LCD_D4 = cLCDNibble.B4;
+        LCD_D5 = cLCDNibble.B5;
+        LCD_D6 = cLCDNibble.B6;
+        LCD_D7 = cLCDNibble.B7;
+        LCD_EN = 1;         // Strobe the nibble into the LCD (450 ns minimum)
+        Delay_us(1);
+        LCD_EN = 0;
+        if (bLCDLowNibble)  // If the whole byte has now been sent
+        {
+          if (bLCDInstruction && cLCDQueue[nLCDQueueHead] <= _LCD_RETURN_HOME)
+            nLCDWaitTicks = LCD_SLOW_INSTRUCTION_TICKS;
+          bLCDInstruction = FALSE;
+          nLCDQueueHead = (nLCDQueueHead + 1) & (LCD_QUEUE_SIZE - 1);
+        }
+        bLCDLowNibble = !bLCDLowNibble;
+      }
+    }
+  }
+  else if (IOCIE_bit && (IOCIF_bit || INT1IF_bit || INT2IF_bit)) // If a button has changed
+  {
+    scanButtons();          // Clears the RB4-7 mismatch before IOCIF is cleared
+    IOCIF_bit = 0;
+    INT1IF_bit = 0;
+    INT2IF_bit = 0;
+  }
+  if (bTelemetryOn)         // Measure how long this interrupt took
+  {
+    Lo(wElapsed) = TMR3L;
+    Hi(wElapsed) = TMR3H;
+    wElapsed -= wStartCount;
+    if (wElapsed > wISRLongestRun) wISRLongestRun = wElapsed;
+    ulISRTotalRun += wElapsed;
+    wISRCount++;
   }
 }
 
 
-void handleOKButton(void)
+byte getEventsPerKeyRepeat()
+{
+  byte nEvents;
+  nEvents = repeatStages[nRepeatStage].nEventsPerStep;
+  if (nKeyRepeatEvents < nEvents)       // Never slower than the configured rate
+    nEvents = nKeyRepeatEvents;
+  return nEvents;
+}
+
+void startKeyRepeat()                   // OK, UP or DOWN has just been pressed
+{
+  wPressedTicks = getTicks();
+  nRepeatStage = 0;
+  nEventsPerKeyRepeat = getEventsPerKeyRepeat();
+}
+
+unsigned int nextKeyRepeatStep()        // OK, UP or DOWN is being held, returns 0 if it is not time to step
+{
+  if (--nEventsPerKeyRepeat != 0) return 0;
+  while (nRepeatStage < REPEAT_STAGES - 1   // Speed up the longer the button is held
+      && getTicks() - wPressedTicks >= repeatStages[nRepeatStage + 1].wHeldTicks)
+    nRepeatStage++;
+  nEventsPerKeyRepeat = getEventsPerKeyRepeat();
+  return repeatStages[nRepeatStage].wStep;
+}
+
+void handleOKButton(byte nType)
 {
   if (bSettingUsage)
   {
-    while (OK_BUTTON_PRESSED);  // Wait for user to release button
-    bSettingUsage = FALSE;
+    if (nType == BUTTON_RELEASED)
+      bSettingUsage = FALSE;
   }
   else if ((usbCommand.s.ux.byte & 0xF0) == USAGE_LOCAL_IRK_FUNCTION)
   {
-    while (OK_BUTTON_PRESSED);  // Wait for user to release button
+    if (nType != BUTTON_RELEASED)   // Act when the button is released
+      return;
     switch (usbCommand.s.yy)
     {
       case CMD_SET_DEVICE_ADDRESS:  // If user is setting this device's address
@@ -1861,7 +3671,7 @@ void handleOKButton(void)
         }
         else // Exiting from address selection, so save the selected address in EEPROM
         {
-          EEPROM_Write(0, nConfigDeviceAddress);
+          EEPROM_Write(EEPROM_DEVICE_ADDRESS, nConfigDeviceAddress);
         }
         break;
       case CMD_SET_BACKLIGHT_DELAY: // If user is setting the LCD backlight delay time
@@ -1889,18 +3699,14 @@ void handleOKButton(void)
         break;
     }
   }
-  else                              // Send the USB function to the host
-  {
+  else if (nType == BUTTON_PRESSED) // Send the USB function to the host
+  { // Note: key repeat is normally a USB host function but IRK! is different
+    startKeyRepeat();
+    executeCommand();
+  }
+  else if (nType == BUTTON_HELD && nextKeyRepeatStep()) // ...and repeat it at the same
+  {                                 // rate as UP/DOWN
     executeCommand();
-    while (OK_BUTTON_PRESSED)
-    { // Note: key repeat is normally a USB host function but IRK! is different
-      if (bKeyRepeatPending && nKeyRepeatDelay <= 0)
-      {
-        executeCommand();
-        bKeyRepeatPending = FALSE;
-        nKeyRepeatDelay = 0;
-      }
-    }
   }
 }
 
@@ -1921,168 +3727,250 @@ void adjustBacklightDelay(signed short nDelta)
   nNewBacklightDelay += nDelta;
 }
 
-void adjustValueBy(signed short nDelta, void (*adjustValue)(signed short), byte (*isButtonPressed)())
-{
-  adjustValue(nDelta);
-  updateLCD();
-  while (isButtonPressed())
-  {
-    if (bKeyRepeatPending && nKeyRepeatDelay <= 0)
-    {
-      adjustValue(nDelta);
-      updateLCD();
-      bKeyRepeatPending = FALSE;
-      nKeyRepeatDelay = 0;
-    }
-  }
-}
-
 void adjustCommandBy(signed short nDelta)
 {
   usbCommand.uxyy = (usbCommand.uxyy & 0xF000) | ((usbCommand.uxyy & 0x0FFF) + nDelta) & 0x0FFF;
 }
 
-void adjustValueOfCommand(signed short nDelta, byte (*isButtonPressed)())
+// Moves to the nearest code, in the direction of nDelta, that has a name or that
+// ends in 0. As codes ending in 0 are never skipped, the search never leaves the
+// current group of 16 codes, so this takes at most 15 shifts whatever the gap.
+void skipUnnamedCodes(signed short nDelta)
 {
-  adjustCommandBy(nDelta);
-  updateLCD();
-  nTicksPerKeyRepeat = FRONT_PANEL_KEY_REPEAT_TICKS;
-  while (isButtonPressed())
+  byte nRow;
+  byte nBit;
+  unsigned int wGroup;
+
+  nRow = getNamedCodeRow();
+  if (nRow == NO_NAMED_CODES)
+    wGroup = 0x0001;
+  else
+    wGroup = wNamedCodes[nRow][usbCommand.s.yy >> 4] | 0x0001;
+  nBit = usbCommand.s.yy & 0x0F;
+  if (nDelta > 0)                     // Find next named code
   {
-    if (bKeyRepeatPending && nKeyRepeatDelay <= 0)
+    wGroup >>= nBit;
+    if (wGroup == 0)
+      nBit = 16;                      // ...which is the start of the next group
+    else
     {
-      if (--nTicksPerKeyRepeat == 0)
+      while (!(wGroup & 0x0001))
       {
-        adjustCommandBy(nDelta);
-        while ((*getDesc() == 0) // Skip over keys with no description...
-            && ((usbCommand.s.yy & 0x0F) != 0x00)) // ...but don't skip functions ending in 0
-        {
-          adjustCommandBy(nDelta);
-        }
-        updateLCD();
-        nTicksPerKeyRepeat = FRONT_PANEL_KEY_REPEAT_TICKS;
+        wGroup >>= 1;
+        nBit++;
       }
-      bKeyRepeatPending = FALSE;
-      nKeyRepeatDelay = 0;
     }
   }
+  else                                // Find previous named code
+  {
+    wGroup <<= 15 - nBit;
+    while (!(wGroup & 0x8000))      // Always stops at bit 0 (the code ending in 0)
+    {
+      wGroup <<= 1;
+      nBit--;
+    }
+  }
+  adjustCommandBy((signed short)nBit - (signed short)(usbCommand.s.yy & 0x0F));
+}
+
+// Moves to the next (or previous) multiple of wStep (0x10 or 0x100) in xyy
+void stepCommandBy(signed short nDelta, unsigned int wStep)
+{
+  unsigned int xyy;
+
+  xyy = usbCommand.uxyy & 0x0FFF;
+  if (nDelta > 0)
+    xyy += wStep;
+  else if ((xyy & (wStep - 1)) == 0) // If already on a multiple of wStep
+    xyy -= wStep;                    // ...go to the previous one
+  xyy &= ~(wStep - 1);               // ...else go down to this one
+  usbCommand.uxyy = (usbCommand.uxyy & 0xF000) | (xyy & 0x0FFF);
 }
 
-void adjustBy(signed short nDelta, byte (*isButtonPressed)())
+void handleUpDownButton(signed short nDelta, byte nType)
 {
-  if (bSettingDeviceAddress)
-    adjustValueBy(nDelta, &adjustDeviceAddress,  isButtonPressed);
+  unsigned int wStep;
+
+  if (nType == BUTTON_RELEASED)
+    return;
+  if (nType == BUTTON_PRESSED)
+  {
+    startKeyRepeat();
+    wStep = 0;                          // A press always moves by one
+  }
+  else
+  {
+    wStep = nextKeyRepeatStep();
+    if (wStep == 0) return;
+  }
+  if (bShowingHistory)
+    adjustHistoryView(nDelta);
+  else if (bSettingDeviceAddress)
+    adjustDeviceAddress(nDelta);
   else if (bSettingBacklightDelay)
-    adjustValueBy(nDelta, &adjustBacklightDelay, isButtonPressed);
+    adjustBacklightDelay(nDelta);
   else if (bSettingUsage)
-    adjustValueBy(nDelta, &adjustUsage,          isButtonPressed);
+    adjustUsage(nDelta);
+  else if (wStep == 0)
+    adjustCommandBy(nDelta);
+  else if (wStep == 1 || (usbCommand.s.ux.byte & 0xF0) == USAGE_KEYBOARD)
+  {
+    adjustCommandBy(nDelta);
+    skipUnnamedCodes(nDelta); // Skip over keys with no description (but not functions ending in 0)
+  }
   else
-    adjustValueOfCommand(nDelta, isButtonPressed);
+    stepCommandBy(nDelta, wStep);
 }
 
-void handleShiftButton(void)
+void handleModifierButton(byte nButton, byte nType)
 {
-  usbCommand.s.ux.bits.LeftShift ^= 1;     // Toggle the SHIFT key modifier
-  while (SHIFT_BUTTON_PRESSED)
+  switch (nButton)
   {
-    if (bKeyRepeatPending && nKeyRepeatDelay <= 0)
-    {
-      if (!bSettingUsage) // Do this only when beginning to set usage
+    case BUTTON_TEACH:
+      if (nType == BUTTON_PRESSED)
+        transmitInfraredCommand();          // Transmit the current key via infrared
+      break;
+    case BUTTON_CTL:
+      if (nType == BUTTON_PRESSED)
+        usbCommand.s.ux.bits.LeftControl ^= 1;  // Toggle the CTL key modifier
+      else if (nType == BUTTON_HELD)
       {
-        usbCommand.uxyy &= 0xF000;    // Keep current u, clear xyy
+        usbCommand.s.ux.bits.LeftControl ^= 1;  // Revert the CTL key modifier
+        usbCommand.s.ux.bits.LeftGUI ^= 1;      // Toggle the GUI key modifier
+        nIgnoredButton = BUTTON_CTL;            // Make it a one-shot change
+      }
+      break;
+    case BUTTON_ALT:
+      if (nType == BUTTON_PRESSED)
+        usbCommand.s.ux.bits.LeftAlt ^= 1;      // Toggle the ALT key modifier
+      break;
+    case BUTTON_SHIFT:
+      if (nType == BUTTON_PRESSED)
+        usbCommand.s.ux.bits.LeftShift ^= 1;    // Toggle the SHIFT key modifier
+      else if (nType == BUTTON_HELD)            // Begin setting usage
+      {
+        usbCommand.uxyy &= 0xF000;              // Keep current u, clear xyy
         bSettingUsage = TRUE;
-        updateLCD();
+        nIgnoredButton = BUTTON_SHIFT;
       }
-      bKeyRepeatPending = FALSE;
-      nKeyRepeatDelay = 0;
-    }
+      break;
   }
-  updateLCD();
 }
 
-void handleCtlButton(void)
+void handleButtonEvent(byte nEvent)
 {
-  usbCommand.s.ux.bits.LeftControl ^= 1;   // Toggle the CTL key modifier
-  while (CTL_BUTTON_PRESSED)
+  byte nButton;
+  byte nType;
+
+  nButton = nEvent & BUTTON_NUMBER;
+  nType = nEvent & BUTTON_EVENT_TYPE;
+  if (nType == BUTTON_PRESSED)
   {
-    if (bKeyRepeatPending && nKeyRepeatDelay <= 0)
+    enableBacklight();                    // Conditionally turn on LCD backlight
+    if (bShowingHistory && nButton != BUTTON_UP && nButton != BUTTON_DOWN)
     {
-      usbCommand.s.ux.bits.LeftControl ^= 1;   // Revert the CTL key modifier
-      usbCommand.s.ux.bits.LeftGUI ^= 1;   // Toggle the GUI key modifier
-      updateLCD();
-      while (CTL_BUTTON_PRESSED); // Make it a one-shot change
-      bKeyRepeatPending = FALSE;
-      nKeyRepeatDelay = 0;
+      bShowingHistory = FALSE;            // Any other button returns to the normal display...
+      nIgnoredButton = nButton;           // ...and does nothing else
     }
   }
-  updateLCD();
+  if (nButton == nIgnoredButton)
+  {
+    if (nType == BUTTON_RELEASED)
+      nIgnoredButton = NO_BUTTON;
+  }
+  else if (nButton == BUTTON_OK)
+    handleOKButton(nType);
+  else if (nButton == BUTTON_UP)
+    handleUpDownButton(+1, nType);
+  else if (nButton == BUTTON_DOWN)
+    handleUpDownButton(-1, nType);
+  else if (!bSettingUsage && !bSettingDeviceAddress && !bSettingBacklightDelay)
+    handleModifierButton(nButton, nType);
+  updateLCD();                            // Show new key state
 }
 
-byte isUpButtonPressed()
+void runInfraredTask()
 {
-  return UP_BUTTON_PRESSED;
+  processInfraredInterrupt();
+  bInfraredInterruptPending = 0;
 }
 
-byte isDownButtonPressed()
+void runUSBTask()
 {
-  return DOWN_BUTTON_PRESSED;
+  if (bUSBReady && HID_Read())        // If the host has sent an output report
+  {
+    processUSBOutputReport();
+  }
+  serviceUSBQueue();                  // Send the next queued report (if any)
+  serviceConfigReply();               // Send the reply to a configuration request (if any)
+  serviceTelemetry();                 // Send telemetry (if the host wants it)
+  serviceUSB();                       // Track USB power and enumeration
+  if (bUSBSuspended)                  // If the host has suspended the USB bus
+  {
+    if (!bLowPowerMode) enterLowPowerMode();
+    if (!bSlowClock && isInfraredIdle()) // On suspend, or once an IR command has
+      useSlowClock();                    // ...been acted on (the tick runs until then)
+  }
+  else if (bLowPowerMode)             // Else if the host has just resumed the bus
+  {
+    exitLowPowerMode();
+  }
+}
+
+void runUITask()
+{
+  if (nButtonEventHead != nButtonEventTail)   // If a button has been pressed, held or released
+  {
+    handleButtonEvent(buttonEvents[nButtonEventHead]);
+    nButtonEventHead = (nButtonEventHead + 1) & (BUTTON_EVENT_QUEUE_SIZE - 1);
+  }
+  updateStatusGlyph();                // Show any change of USB, IR or queue state
+  serviceLCD();                       // Redraw the display if it is out of date
+}
+
+void runTask(byte nTask)
+{
+  unsigned int wStartTicks;
+  unsigned int wStartCount;
+  unsigned int wElapsed;
+
+  wStartTicks = getTicks();
+  wStartCount = getTimer3Count();
+  switch (nTask)
+  {
+    case TASK_INFRARED: runInfraredTask(); break;
+    case TASK_USB:      runUSBTask();      break;
+    default:            runUITask();       break;
+  }
+  if (bTelemetryOn)                   // Measure how long the task ran for
+  {
+    wElapsed = getTimer3Count() - wStartCount;
+    if (getTicks() - wStartTicks >= TIMER3_WRAP_TICKS - 1) // If Timer3 may have wrapped
+      wElapsed = 0xFFFF;
+    if (wElapsed > wTaskLongestRun[nTask]) wTaskLongestRun[nTask] = wElapsed;
+  }
+  nLastTask = nTask;
 }
 
 void main()
 {
   Prolog();
 
+  nLastTask = TASK_UI;
   while (FOREVER)
   {
-    if (bInfraredInterruptPending)
+    if (bInfraredInterruptPending)      // An IR edge is always handled first...
     {
-      processInfraredInterrupt();
-      bInfraredInterruptPending = 0;
+      runTask(TASK_INFRARED);
     }
-    if (ACTIVITY_LED)
+    else if (nLastTask == TASK_USB)     // ...then the user interface and USB take turns
     {
-      if (--nActivityLEDDelay == 0)
-      {
-        ACTIVITY_LED = OFF;
-      }
+      runTask(TASK_UI);
     }
-    if (((PORTB & 0b11110111) ^ 0b11110111))     // If any button is pressed (low)
-    {
-      enableBacklight();          // Conditionally turn on LCD backlight
-      Delay_ms(25);               // Debounce delay
-      nKeyRepeatDelay = KEY_REPEAT_DELAY_IN_TICKS;  // Number of Timer3 interrupts before starting key repeat
-      TMR3H = 0;                  // Prime the Timer3 high byte
-      TMR3L = 0;                  // Now clear the Timer3 counter
-      TMR3ON_bit = ON;            // Turn on the key repeat timer
-      if (!bSettingUsage && !bSettingDeviceAddress && !bSettingBacklightDelay)
-      {
-        if (TEACH_BUTTON_PRESSED)   // Transmit the current key via infrared
-        {
-          transmitInfraredCommand();
-          while (TEACH_BUTTON_PRESSED); // Wait for button to be released
-        }
-        if (CTL_BUTTON_PRESSED) handleCtlButton();
-        if (ALT_BUTTON_PRESSED)         // Toggle the ALT key modifier
-        {
-          usbCommand.s.ux.bits.LeftAlt ^= 1;
-          while (ALT_BUTTON_PRESSED);   // Wait for button to be released
-        }
-        if (SHIFT_BUTTON_PRESSED) handleShiftButton();
-      }
-      if (OK_BUTTON_PRESSED)    handleOKButton();
-      if (UP_BUTTON_PRESSED)    adjustBy(+1, &isUpButtonPressed);
-      if (DOWN_BUTTON_PRESSED)  adjustBy(-1, &isDownButtonPressed);
-      TMR3ON_bit = OFF;                 // Turn off the key repeat timer
-      bKeyRepeatPending = FALSE;
-      updateLCD();                      // Show final key state
-    }
-    if (bLastUSBPower ^ USB_POWER_GOOD) // If USB power state has changed
+    else
     {
-      if (USB_POWER_GOOD)               // If USB is now powered
-        enableUSB();                    // Then enable USB interface
-      else                              // Else USB is now unpowered
-        disableUSB();                   // So disable USB interface
-      bLastUSBPower = USB_POWER_GOOD;   // Remember the current USB power state
+      runTask(TASK_USB);
+      waitForInterrupt();               // Idle until there is something to do
     }
   }
-}
\ No newline at end of file
+}
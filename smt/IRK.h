@@ -1,3 +1,5 @@
 #define REPORT_ID_KEYBOARD          'K'
 #define REPORT_ID_SYSTEM_CONTROL    'S'
-#define REPORT_ID_CONSUMER_DEVICE   'C'
\ No newline at end of file
+#define REPORT_ID_CONSUMER_DEVICE   'C'
+#define REPORT_ID_CONFIG            'F'
+#define REPORT_ID_TELEMETRY         'T'
\ No newline at end of file
@@ -31,7 +31,7 @@
 
 const unsigned int USB_VENDOR_ID = 0x5249;   // 'IR'
 const unsigned int USB_PRODUCT_ID = 0x214B;  // 'K!'
-const char USB_SELF_POWER = 0x80;            // 0x80 = Bus powered, 0xC0 = Self powered
+const char USB_SELF_POWER = 0xA0;            // 0x80 = Bus powered, 0xC0 = Self powered, +0x20 = Remote wakeup
 const char USB_MAX_POWER = 50;               // Bus power required in units of 2 mA
 const char USB_TRANSFER_TYPE = 0x03;         // 0x03 Interrupt
 const char EP_IN_INTERVAL = 10;              // Measured in frame counts, that is:
@@ -54,7 +54,9 @@ const char USB_HID_EP = 1;
 const char USB_HID_RPT_SIZE = 42  // Keyboard       --> host
                             + 21  // Keyboard       <-- host
                             + 25  // SystemControl  --> host
-                            + 25; // ConsumerDevice --> host
+                            + 25  // ConsumerDevice --> host
+                            + 27  // Config         <-> host
+                            +  8; // Telemetry      --> host
 /* Device Descriptor */
 const struct
 {
@@ -83,7 +85,7 @@ const struct
       8,                      // bMaxPacketSize0
       USB_VENDOR_ID,          // idVendor
       USB_PRODUCT_ID,         // idProduct
-      0x0003,                 // bcdDevice
+      0x0305,                 // bcdDevice (IRK_VERSION 3.05)
       STRING_INDEX_IRK,       // iManufacturer
       STRING_INDEX_IRK_DESC,  // iProduct
       0x00,                   // iSerialNumber
@@ -266,6 +268,56 @@ Consumer Device Input Report (PIC --> Host) 3 bytes as follows:
   0x95, 0x01,                  //   (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields <-- Redundant: REPORT_COUNT is already 1
   0x81, 0x00,                  //   (MAIN)   INPUT              0x00000000 (1 field x 16 bits) 0=Data 0=Array 0=Absolute 0=Ignored 0=Ignored 0=PrefState 0=NoNull
   0xC0,                        // (MAIN)   END_COLLECTION     Application
+
+/*
+Configuration Input and Output Reports (PIC <-> Host) 8 bytes as follows:
+    .---------------------------------------.
+    |           REPORT_ID_CONFIG            | IN/OUT: Report Id
+    |---------------------------------------|
+    |              Operation                | IN/OUT: 'I'=Info, 'R'=Read, 'W'=Write
+    |---------------------------------------|
+    |            EEPROM Address             | IN/OUT: First EEPROM byte to read or write
+    |---------------------------------------|
+    |                Length                 | OUT: Bytes to read or write (0 to 4)
+    |                                       | IN:  Bytes actually read or written
+    |---------------------------------------|
+    |             Data (4 bytes)            | OUT: Bytes to write (ignored for Read)
+    |                                       | IN:  EEPROM contents after the operation
+    '---------------------------------------'
+This is a separate top-level collection so that host applications can open it
+(e.g. via hidraw or the Windows HID API) even though the host operating system
+has exclusive access to the Keyboard collection. Input and Output reports are
+used rather than Feature reports because they travel over the existing
+interrupt endpoints and so need no extra control transfer handling.
+
+Telemetry Input Report (PIC --> Host) 8 bytes as follows:
+    .---------------------------------------.
+    |          REPORT_ID_TELEMETRY          | IN: Report Id
+    |---------------------------------------|
+    |              Record type              | IN: 'F'=Frame, 'R'=Result, 'X'=Resets, 'U'=USB, 'S'=Tasks, 'I'=Interrupts, 'W'=Idle
+    |---------------------------------------|
+    |           Record (6 bytes)            | IN: See "FORMATS" in IRK.c
+    '---------------------------------------'
+Telemetry is only sent after the host has asked for it using the 'T'
+operation on the configuration channel.
+*/
+  0x06, 0x00, 0xFF,            // (GLOBAL) USAGE_PAGE         0xFF00 Vendor-defined
+  0x09, 0x01,                  // (LOCAL)  USAGE              0xFF000001 IRK! Configuration
+  0xA1, 0x01,                  // (MAIN)   COLLECTION         0x01 Application (Usage=0xFF000001: Page=Vendor-defined, Usage=IRK! Configuration, Type=CA)
+  0x85, REPORT_ID_CONFIG,      //   (GLOBAL) REPORT_ID          0x46 (70) 'F'
+  0x15, 0x00,                  //   (GLOBAL) LOGICAL_MINIMUM    0x00 (0)
+  0x26, 0xFF, 0x00,            //   (GLOBAL) LOGICAL_MAXIMUM    0x00FF (255)
+  0x75, 0x08,                  //   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field
+  0x95, 0x07,                  //   (GLOBAL) REPORT_COUNT       0x07 (7) Number of fields
+  0x09, 0x01,                  //   (LOCAL)  USAGE              0xFF000001 IRK! Configuration
+  0x81, 0x02,                  //   (MAIN)   INPUT              0x00000002 (7 fields x 8 bits) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap
+  0x09, 0x01,                  //   (LOCAL)  USAGE              0xFF000001 IRK! Configuration
+  0x91, 0x02,                  //   (MAIN)   OUTPUT             0x00000002 (7 fields x 8 bits) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap
+  0x85, REPORT_ID_TELEMETRY,   //   (GLOBAL) REPORT_ID          0x54 (84) 'T'
+  0x95, 0x07,                  //   (GLOBAL) REPORT_COUNT       0x07 (7) Number of fields <-- Redundant: REPORT_COUNT is already 7
+  0x09, 0x02,                  //   (LOCAL)  USAGE              0xFF000002 IRK! Telemetry
+  0x81, 0x02,                  //   (MAIN)   INPUT              0x00000002 (7 fields x 8 bits) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap
+  0xC0,                        // (MAIN)   END_COLLECTION     Application
     }
   };
 